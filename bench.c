@@ -0,0 +1,454 @@
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef UI
+#define main keiko_main  // keiko itself, less its main
+#include "keiko.c"
+#undef main
+#else
+#include "engine.h"
+#endif
+
+// keiko-bench: microbenchmarks for the engine hot paths.
+//
+//   keiko-bench [-o results.json] [file.orca ...]
+//   keiko-bench-ui [-o results.json]
+//
+// Every case fills a fresh grid (random cells, or a patch tiled to the grid
+// size), runs a few warmup frames and then times SAMPLES batches.  It reports
+// the mean cost per frame and per cell, with a 95% confidence interval from
+// the spread of the batches.  Larger grids run fewer frames so every case
+// touches about the same number of cells.  With -o every result is also
+// written to a JSON array, for tracking regressions.  keiko-bench-ui is
+// this file built with -DUI against keiko.c: it times keiko's redraw()
+// instead, offscreen, and needs SDL and JACK to build.
+
+#define FRAMES 2000
+#define WARMUP  100
+#define CALLS   (1 << 24)
+#define NOTES   (1 << 20)  // smf_note calls per MIDI case
+#define PERIOD  256        // frames in a JACK period, for the voice table cases
+
+#define SAMPLES  10     // timed batches per case
+#define T95      2.262  // Student's t for a 95% interval over SAMPLES batches
+
+#define GRIDS  32  // documents in the scheduler case
+
+#define REDRAWS  500  // redraw() calls per sample
+
+#ifndef UI
+Document doc;
+#endif
+FILE*    json;     // -o: results so far, as a JSON array
+int      results;  // written to json
+
+double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Prints one case: the mean of the samples (ns for one 'unit') with its 95%
+// confidence interval, per cell when 'cells' > 0, and 'extra'.
+void
+report(char* name, char* unit, int w, int h, double* ns, double cells, char* extra)
+{
+  double mean = 0, var = 0;
+  for (int i = 0; i < SAMPLES; i++) mean += ns[i] / SAMPLES;
+  for (int i = 0; i < SAMPLES; i++) var  += (ns[i] - mean) * (ns[i] - mean) / (SAMPLES - 1);
+  double ci = T95 * sqrt(var / SAMPLES);
+  char   size[16] = "";
+  if (w) snprintf(size, sizeof size, "%4dx%-4d", w, h);
+  printf("%-20s %9s %12.2f ±%9.2f ns/%-5s", name, size, mean, ci, unit);
+  if (cells > 0) printf(" %8.2f ns/cell", mean / cells);
+  printf("%s\n", extra);
+  if (!json) return;
+  fprintf(json, "%s  { \"name\": \"%s\", \"unit\": \"ns/%s\", \"width\": %d, \"height\": %d, \"mean\": %.3f, \"ci95\": %.3f",
+          results++ ? ",\n" : "", name, unit, w, h, mean, ci);
+  if (cells > 0) fprintf(json, ", \"per_cell\": %.4f", mean / cells);
+  fprintf(json, ", \"samples\": [");
+  for (int i = 0; i < SAMPLES; i++) fprintf(json, "%s%.3f", i ? ", " : "", ns[i]);
+  fprintf(json, "] }");
+}
+
+// fill grid with characters drawn from 'alphabet' (xorshift, fixed seed)
+void
+fill_grid(Grid* g, char* alphabet)
+{
+  Uint seed = 2463534242U;
+  int  n    = strlen(alphabet);
+  for (int i = 0; i < g->length; i++) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    set_cell(g, i % g->width, i / g->width, alphabet[seed % n]);
+  }
+}
+
+// repeat the patch 't' across the whole of 'g'
+void
+tile_grid(Grid* g, Grid* t)
+{
+  for   (int y = 0; y < g->height; y++)
+    for (int x = 0; x < g->width;  x++)
+      set_cell(g, x, y, get_cell(t, x % t->width, y % t->height));
+}
+
+void
+time_grid(char* name, Grid* g, char* extra)
+{
+  double ns[SAMPLES];
+  int    w      = g->width, h = g->height;
+  int    frames = clamp(FRAMES * HOR * VER / (w * h), SAMPLES, FRAMES) / SAMPLES;
+  int    warmup = clamp(WARMUP * HOR * VER / (w * h), 1, WARMUP);
+  for (int i = 0; i < warmup; i++) run_grid(g);
+  for (int s = 0; s < SAMPLES; s++) {
+    double start = now();
+    for (int i = 0; i < frames; i++) run_grid(g);
+    ns[s] = (now() - start) * 1e9 / frames;
+  }
+  report(name, "frame", w, h, ns, g->length, extra);
+}
+
+void
+bench_grid(char* name, char* alphabet, int w, int h)
+{
+  if (!init_grid(&doc.grid, w, h)) return;
+  fill_grid(&doc.grid, alphabet);
+  time_grid(name, &doc.grid, "");
+}
+
+// one operator among values and empty cells
+void
+bench_op(char c, int w, int h)
+{
+  char name[16], alphabet[16];
+  snprintf(name,     sizeof name,     "op %c", c);
+  snprintf(alphabet, sizeof alphabet, "%c%c0123456789..", c, c);
+  bench_grid(name, alphabet, w, h);
+}
+
+void
+bench_patch(char* file, int w, int h)
+{
+  Document patch = { 0 };
+  if (!open_doc(&patch, file))     return;
+  if (!init_grid(&doc.grid, w, h)) return;
+  tile_grid(&doc.grid, &patch.grid);
+  time_grid(file, &doc.grid, "");
+  free_grid(&patch.grid);
+}
+
+// GRIDS independent 256x256 grids stepped together on a pool of 'threads'
+// threads plus the caller; ns/cell is per cell of all grids
+void
+bench_pool(char* alphabet, int threads)
+{
+  Pool   pool;
+  Grid   grids[GRIDS] = { 0 };
+  Grid*  list[GRIDS];
+  char   name[32];
+  double ns[SAMPLES];
+  if (!init_pool(&pool, threads)) return;
+  for (int i = 0; i < GRIDS; i++) {
+    if (!init_grid(&grids[i], 256, 256)) return;
+    fill_grid(&grids[i], alphabet);
+    list[i] = &grids[i];
+  }
+  int cells  = GRIDS * 256 * 256;
+  int frames = clamp(FRAMES * HOR * VER / cells, SAMPLES, FRAMES) / SAMPLES;
+  for (int i = 0; i < 10; i++) run_grids(&pool, list, GRIDS);
+  for (int s = 0; s < SAMPLES; s++) {
+    double start = now();
+    for (int i = 0; i < frames; i++) run_grids(&pool, list, GRIDS);
+    ns[s] = (now() - start) * 1e9 / frames;
+  }
+  snprintf(name, sizeof name, "%d grids, %d+1 thr", GRIDS, threads);
+  report(name, "frame", 256, 256, ns, cells, "");
+  for (int i = 0; i < GRIDS; i++) free_grid(&grids[i]);
+  free_pool(&pool);
+}
+
+// doc.grid run as row bands on a pool of 'threads' threads plus the caller;
+// also reports how many bands per frame had to be re-run serially
+void
+bench_bands(char* name, int threads)
+{
+  Pool   pool;
+  Bands  bands;
+  char   label[32], extra[32];
+  double ns[SAMPLES];
+  int    w = doc.grid.width, h = doc.grid.height, reruns = 0;
+  int    frames = clamp(FRAMES * HOR * VER / (w * h), SAMPLES, FRAMES) / SAMPLES;
+  if (!init_pool(&pool, threads))                         return;
+  if (!init_bands(&bands, &doc.grid, threads + 1)) { free_pool(&pool); return; }
+  for (int i = 0; i < 10; i++) run_bands(&pool, &bands);
+  for (int s = 0; s < SAMPLES; s++) {
+    double start = now();
+    for (int i = 0; i < frames; i++) { run_bands(&pool, &bands); reruns += bands.reruns; }
+    ns[s] = (now() - start) * 1e9 / frames;
+  }
+  snprintf(label, sizeof label, "%.11s %d+1 thr", name, threads);
+  snprintf(extra, sizeof extra, " %5.2f/%d reruns", (double)reruns / (frames * SAMPLES), bands.n_bands);
+  report(label, "frame", w, h, ns, w * h, extra);
+  free_bands(&bands);
+  free_pool(&pool);
+}
+
+int notes;  // counted by count_midi
+
+void
+count_midi(void* arg, int channel, int value, int velocity, int length)
+{
+  notes++;
+}
+
+// op_midi handing notes to a MidiFn: rows of ':' operators banged every
+// frame by a D above them; also reports the notes sent per frame
+void
+bench_midi(int w, int h)
+{
+  char extra[32];
+  if (!init_grid(&doc.grid, w, h)) return;
+  for   (int y = 0; y + 1 < h; y += 2)
+    for (int x = 0; x + 7 < w; x += 8)
+      for (int i = 0; i < 8; i++) {
+        set_cell(&doc.grid, x + i, y,     ".D1....."[i]);
+        set_cell(&doc.grid, x + i, y + 1, "..:03C.5"[i]);  // channel 0, octave 3, C, loudest, 5 frames
+      }
+  doc.grid.midi = count_midi;
+  notes         = 0;
+  run_grid(&doc.grid);
+  snprintf(extra, sizeof extra, " %d notes/frame", notes);
+  time_grid("op_midi", &doc.grid, extra);
+  doc.grid.midi = NULL;
+}
+
+// smf_note with 'voices' notes sounding: every note retriggers one of them
+void
+bench_smf(int voices)
+{
+  Smf    smf;
+  char   name[32];
+  double ns[SAMPLES];
+  if (!init_grid(&doc.grid, HOR, VER))                  return;
+  if (!open_smf(&smf, "/dev/null", &doc.grid, 120)) return;
+  for (int i = 0; i < voices; i++) smf_note(&smf, i % VOICES, i / VOICES, 10, N_VARS);
+  for (int s = 0; s < SAMPLES; s++) {
+    double start = now();
+    for (int i = 0; i < NOTES / SAMPLES; i++) smf_note(&smf, i % voices % VOICES, i % voices / VOICES, 10, N_VARS);
+    ns[s] = (now() - start) * 1e9 / (NOTES / SAMPLES);
+  }
+  close_smf(&smf);
+  snprintf(name, sizeof name, "smf_note %d voices", voices);
+  report(name, "note", 0, 0, ns, 0, "");
+}
+
+// process() with 'voices' notes arriving in one period, then the next
+// period with those still sounding: start_note with retriggers and
+// stealing, then play_voices; times are per period
+void
+bench_voices(int voices)
+{
+  Voices     v = { 0 };
+  MidiEvent* ev;
+  char       name[40], extra[32];
+  double     ns[SAMPLES], held[SAMPLES];
+  int        n, sounding = 0;
+  if (!(ev = malloc(voices * 3 * sizeof *ev))) return;
+  for (int s = 0; s < SAMPLES; s++) {
+    if (!init_voices(&v, voices)) break;
+    double start = now();
+    n = 0;
+    for (int i = 0; i < voices; i++) {
+      // every key in turn; a repeat lands later than the one it retriggers
+      MidiNote note = { i % VOICES, i / VOICES % 128, 100, PERIOD * 4, true, (Uint)((Uint64)i * PERIOD / voices) };
+      start_note(&v, &note, voices, ev, &n);
+    }
+    play_voices(&v, 0, PERIOD, ev, &n);
+    ns[s] = (now() - start) * 1e9;
+    sounding = v.count;
+    start    = now();
+    n        = 0;
+    play_voices(&v, PERIOD, PERIOD, ev, &n);
+    held[s] = (now() - start) * 1e9;
+  }
+  free_voices(&v);
+  free(ev);
+  snprintf(name, sizeof name, "process %d notes", voices);
+  report(name, "period", 0, 0, ns, 0, "");
+  snprintf(name, sizeof name, "process %d sounding", voices);
+  snprintf(extra, sizeof extra, " %d voices", sounding);
+  report(name, "period", 0, 0, held, 0, extra);
+}
+
+// open_doc and save_doc on a generated w x h patch
+void
+bench_docs(int w, int h)
+{
+  char     file[] = "/tmp/keiko-bench-XXXXXX", snap[sizeof file + 8];
+  double   load[SAMPLES], save[SAMPLES], snap_load[SAMPLES], snap_save[SAMPLES], merge[SAMPLES];
+  Document d = { 0 };
+  Merge    m;
+  int      fd = mkstemp(file);
+  if (fd < 0 || !init_grid(&doc.grid, w, h)) return;
+  close(fd);
+  snprintf(snap, sizeof snap, "%s" SNAP_SUFFIX, file);
+  fill_grid(&doc.grid, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz*#.0123456789.........");
+  save_doc(&doc, file);
+  for (int s = 0; s < SAMPLES; s++) {
+    double start = now();
+    save_doc(&doc, file);
+    save[s]      = (now() - start) * 1e9;
+    start        = now();
+    open_doc(&d, file);
+    load[s]      = (now() - start) * 1e9;
+    start        = now();
+    write_grid(&doc.grid, snap);
+    snap_save[s] = (now() - start) * 1e9;
+    start        = now();
+    open_doc(&d, snap);
+    snap_load[s] = (now() - start) * 1e9;
+    for (int k = 0; k < 64; k++)  // a reload that changed a few cells
+      set_cell(&d.grid, (s * 7919 + k * 104729) % w, (s * 31 + k * 613) % h, "ABC*#"[k % 5]);
+    start        = now();
+    merge_grid(&doc.grid, &d.grid, &m);
+    merge[s]     = (now() - start) * 1e9;
+  }
+  report("save_doc",      "file", w, h, save,      w * h, "");
+  report("open_doc",      "file", w, h, load,      w * h, "");
+  report("save_snapshot", "file", w, h, snap_save, w * h, "");
+  report("open_snapshot", "file", w, h, snap_load, w * h, "");
+  report("merge_grid",    "file", w, h, merge,     w * h, "");
+  free_grid(&d.grid);
+  unlink(file);
+  unlink(snap);
+}
+
+volatile int sink;  // keeps the helper calls from being optimised away
+
+// cost of one call to a character helper, cycling through all 256 bytes
+void
+bench_helper(char* name, int (*fn)(int i))
+{
+  double ns[SAMPLES];
+  int    acc = 0;
+  for (int i = 0; i < CALLS / 16; i++) acc += fn(i);
+  for (int s = 0; s < SAMPLES; s++) {
+    double start = now();
+    for (int i = 0; i < CALLS / SAMPLES; i++) acc += fn(i);
+    ns[s] = (now() - start) * 1e9 / (CALLS / SAMPLES);
+  }
+  sink = acc;
+  report(name, "call", 0, 0, ns, 0, "");
+}
+
+int call_cb36(int i)  { return cb36(i); }
+int call_cchr(int i)  { return cchr((i >> 8 & 63) - 8, i); }
+int call_ctbl(int i)  { return ctbl(i); }
+int call_cuca(int i)  { return cuca(i); }
+int call_clca(int i)  { return clca(i); }
+int call_valid(int i) { return valid_character(i); }
+
+#ifdef UI
+// redraw() with every cell changed since the last frame, and with nothing
+// changed: only changed cells have their vertices rewritten, but the whole
+// screen is rendered either way.  SDL's dummy video driver and software
+// renderer stand in for the screen, without vsync.
+void
+bench_redraw()
+{
+  Document a = { 0 }, b = { 0 };
+  double   full[SAMPLES], idle[SAMPLES];
+  setenv("SDL_VIDEODRIVER", "dummy", 0);
+  SDL_SetHint(SDL_HINT_RENDER_DRIVER, "software");
+  SDL_SetHint(SDL_HINT_RENDER_VSYNC, "0");
+  if (SDL_Init(SDL_INIT_VIDEO) < 0) { error("Bench", SDL_GetError()); return; }
+  if (!create_ui() || !init_grid(&a.grid, HOR, VER) || !init_grid(&b.grid, HOR, VER)) return;
+  fill_grid(&a.grid, "ab");
+  fill_grid(&b.grid, "ba");  // the same draws: every cell differs from a's
+  for (int s = 0; s < SAMPLES; s++) {
+    double t = 0;
+    for (int i = 0; i < REDRAWS; i++) {
+      publish(i % 2 ? &a : &b);
+      double start = now();
+      redraw();
+      t += now() - start;
+    }
+    full[s] = t * 1e9 / REDRAWS;
+    double start = now();
+    for (int i = 0; i < REDRAWS; i++) redraw();
+    idle[s] = (now() - start) * 1e9 / REDRAWS;
+  }
+  report("redraw full", "frame", HOR, VER, full, HOR * VER, "");
+  report("redraw idle", "frame", HOR, VER, idle, HOR * VER, "");
+  free_grid(&a.grid);
+  free_grid(&b.grid);
+  SDL_Quit();
+}
+#endif
+
+int
+main(int argc, char* argv[])
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "o:")) != -1) {
+    if (opt != 'o') { fprintf(stderr, "usage: %s [-o results.json] [file.orca ...]\n", argv[0]); return 1; }
+    if (!(json = fopen(optarg, "w"))) { error("Bench", "Cannot open output file"); return 1; }
+  }
+  if (json) fprintf(json, "[\n");
+#ifdef UI
+  bench_redraw();
+#else
+  bench_helper("cb36",            call_cb36);
+  bench_helper("cchr",            call_cchr);
+  bench_helper("ctbl",            call_ctbl);
+  bench_helper("cuca",            call_cuca);
+  bench_helper("clca",            call_clca);
+  bench_helper("valid_character", call_valid);
+  for (char* c = "ABCDEFGHIJKLMNOPQRSTUVWXYZ*#:"; *c; c++)
+    bench_op(*c, 256, 256);
+  int sizes[][2] = { { HOR, VER }, { 256, 256 }, { 1024, 1024 }, { 2048, 2048 } };
+  for (int i = 0; i < 4; i++) {
+    int w = sizes[i][0], h = sizes[i][1];
+    bench_grid("empty",              ".",                        w, h);
+    bench_grid("values",             "0123456789",               w, h);
+    bench_grid("sparse operators",   "...................ACDRU", w, h);
+    bench_grid("dense operators",    "ABCDFHIKLMRUVZ",           w, h);
+    bench_grid("dense lowercase",    "abcdfhiklmruvz*",          w, h);
+    bench_grid("unbanged lowercase", "abcdfhiklmruvz",           w, h);
+    bench_grid("dense movement",     "ENSW.",                    w, h);
+    bench_grid("dense mixed",        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz*#.0123456789", w, h);
+    for (int f = optind; f < argc; f++)
+      bench_patch(argv[f], w, h);
+  }
+  bench_midi(256, 256);
+  for (int v = 1; v <= SMF_POLY; v *= 4)
+    bench_smf(v);
+  for (int v = 1; v <= 10000; v *= 10)
+    bench_voices(v);
+  bench_docs(1024, 1024);
+  int cores = sysconf(_SC_NPROCESSORS_ONLN);
+  for (int t = 0; t < cores; t = t ? t * 2 : 1)
+    bench_pool("ABCDFHIKLMRUVZ", t);
+  for (int t = 0; t < cores; t = t ? t * 2 : 1) {
+    init_grid(&doc.grid, 1024, 1024);
+    fill_grid(&doc.grid, "ABCDFHIKLMRUVZ");
+    bench_bands("dense", t);
+  }
+  for (int f = optind; f < argc; f++) {
+    Document patch = { 0 };
+    if (!open_doc(&patch, argv[f])) continue;
+    for (int t = 0; t < cores; t = t ? t * 2 : 1) {
+      init_grid(&doc.grid, 1024, 1024);
+      tile_grid(&doc.grid, &patch.grid);
+      bench_bands(argv[f], t);
+    }
+    free_grid(&patch.grid);
+  }
+#endif
+  if (json) { fprintf(json, "\n]\n"); fclose(json); }
+  return 0;
+}
@@ -0,0 +1,2025 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "engine.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SIMD_X86
+#endif
+
+// =======================================================================  
+// ============================== Operators ==============================  
+// =======================================================================  
+
+// on a band's copy, mark cell i as seen by the band (see run_bands)
+#define TRACK(g, i) ((g)->band ? (void)((g)->band->seen[(i) / 64] |= 1ULL << ((i) % 64)) : (void)0)
+
+#define DOTS  0x2e2e2e2e2e2e2e2eULL  // eight empty cells, read as one word
+
+// indexed by cell character; '.', values and invalid characters have no handler
+const Op ops[256] = {
+  ['A'] = { op_a,       0       }, ['a'] = { op_a, OP_BANG           },  // add(a b)             Outputs sum of inputs.
+  ['B'] = { op_b,       0       }, ['b'] = { op_b, OP_BANG           },  // subtract(a b)        Outputs difference of inputs.
+  ['C'] = { op_c,       0       }, ['c'] = { op_c, OP_BANG           },  // clock(rate mod)      Outputs modulo of frame.
+  ['D'] = { op_d,       0       }, ['d'] = { op_d, OP_BANG           },  // delay(rate mod)      Bangs on modulo of frame.
+  ['E'] = { op_e,       OP_MOVE }, ['e'] = { op_e, OP_BANG | OP_MOVE },  // east                 Moves eastward, or bangs.
+  ['F'] = { op_f,       0       }, ['f'] = { op_f, OP_BANG           },  // if(a b)              Bangs if inputs are equal.
+  ['G'] = { op_g,       0       }, ['g'] = { op_g, OP_BANG           },  // generator(x y len)   Writes operands with offset.
+  ['H'] = { op_h,       0       }, ['h'] = { op_h, OP_BANG           },  // halt                 Halts southward operand.
+  ['I'] = { op_i,       0       }, ['i'] = { op_i, OP_BANG           },  // increment(step mod)  Increments southward operand.
+  ['J'] = { op_j,       0       }, ['j'] = { op_j, OP_BANG           },  // jumper(val)          Outputs northward operand.
+  ['K'] = { op_k,       0       }, ['k'] = { op_k, OP_BANG           },  // konkat(len)          Reads multiple variables.
+  ['L'] = { op_l,       0       }, ['l'] = { op_l, OP_BANG           },  // less(a b)            Outputs smallest of inputs.
+  ['M'] = { op_m,       0       }, ['m'] = { op_m, OP_BANG           },  // multiply(a b)        Outputs product of inputs.
+  ['N'] = { op_n,       OP_MOVE }, ['n'] = { op_n, OP_BANG | OP_MOVE },  // north                Moves Northward, or bangs.
+  ['O'] = { op_o,       0       }, ['o'] = { op_o, OP_BANG           },  // read(x y read)       Reads operand with offset.
+  ['P'] = { op_p,       0       }, ['p'] = { op_p, OP_BANG           },  // push(len key val)    Writes eastward operand.
+  ['Q'] = { op_q,       0       }, ['q'] = { op_q, OP_BANG           },  // query(x y len)       Reads operands with offset.
+  ['R'] = { op_r,       0       }, ['r'] = { op_r, OP_BANG           },  // random(min max)      Outputs random value.
+  ['S'] = { op_s,       OP_MOVE }, ['s'] = { op_s, OP_BANG | OP_MOVE },  // south                Moves southward, or bangs.
+  ['T'] = { op_t,       0       }, ['t'] = { op_t, OP_BANG           },  // track(key len val)   Reads eastward operand.
+  ['U'] = { op_u,       0       }, ['u'] = { op_u, OP_BANG           },  // uclid(step max)      Bangs on Euclidean rhythm.
+  ['V'] = { op_v,       0       }, ['v'] = { op_v, OP_BANG           },  // variable(write read) Reads and writes variable.
+  ['W'] = { op_w,       OP_MOVE }, ['w'] = { op_w, OP_BANG | OP_MOVE },  // west                 Moves westward, or bangs.
+  ['X'] = { op_x,       0       }, ['x'] = { op_x, OP_BANG           },  // write(x y val)       Writes operand with offset.
+  ['Y'] = { op_y,       0       }, ['y'] = { op_y, OP_BANG           },  // jymper(val)          Outputs westward operand.
+  ['Z'] = { op_z,       0       }, ['z'] = { op_z, OP_BANG           },  // lerp(rate target)    Transitions operand to input.
+  ['*'] = { op_bang,    0       },                                       // bang                 Bangs neighboring operands.
+  ['#'] = { op_comment, 0       },                                       // comment              Halts a line.
+  [':'] = { op_midi,    0       },                                       // midi                 Sends a MIDI note.
+};
+
+void
+run_grid(Grid* g)
+{
+  init_grid_frame(g);
+  run_cells(g, 0, g->length);
+  // print_lock_grid(g);
+  g->frame++;
+}
+
+// operators in cells [from, to), in row-major order
+void
+run_cells(Grid* g, int from, int to)
+{
+  for (int w = from / 64; from < to && w <= (to - 1) / 64; w++) {
+    Uint64 mask = span(w, from, to);
+    Uint64 bits = g->active[w] & mask;
+    while (bits) {
+      int i = w * 64 + __builtin_ctzll(bits);
+      run_cell(g, i);
+      bits = g->active[w] & mask & (~1ULL << (i & 63));  // re-read; operators may have moved or vanished
+    }
+  }
+}
+
+// A band's copy asks bangged() every time: its bang bitmap misses the '*'s
+// other bands write, and bangged() records the cells the answer rests on.
+void
+run_cell(Grid* g, int i)
+{
+  Uint8     c  = g->data[i];
+  const Op* op = &ops[c];
+  TRACK(g, i);
+  if (g->meta[i] & LOCK) return;
+  int  x    = i % g->width;
+  int  y    = i / g->width;
+  bool hint = g->band || g->bang[i / 64] >> (i % 64) & 1;
+  if (op->flags & OP_BANG && !(hint && bangged(g, x, y))) return;
+  set_type(g, x, y, Operator);
+  op->fn(g, x, y, c);
+}
+
+void
+init_grid_frame(Grid* g)
+{
+  memset(g->meta, NoOp, g->length * sizeof *g->meta);
+  memset(g->vars, '.',  N_VARS * sizeof *g->vars);
+  g->period = 1;
+  find_bangs(g);
+}
+
+// Builds the active plane from data, as set_cell would have kept it
+void
+find_active(Grid* g)
+{
+  for (int k = 0; k < WORDS(g->length); k++) {
+    Uint64 bits = 0, v;
+    for (int j = 0; j < 64; j += 8) {  // the data plane is padded with '.' to whole words
+      memcpy(&v, g->data + k * 64 + j, 8);
+      if (v == DOTS) continue;
+      for (int b = j; b < j + 8; b++)
+        bits |= (Uint64)(ops[g->data[k * 64 + b]].fn != NULL) << b;
+    }
+    g->active[k] = bits;
+  }
+}
+
+// Builds the bang bitmap: every neighbour of a '*' cell.  '*' cells written
+// during the frame are added by set_cell; erased ones are not removed, so a
+// set bit is only a hint and run_cell confirms it with bangged().
+void
+find_bangs(Grid* g)
+{
+  int     words = WORDS(g->length);
+  int     q     = g->width / 64;
+  int     r     = g->width % 64;
+  Uint64* s     = g->star;
+#ifdef SIMD_X86
+  if      (__builtin_cpu_supports("avx2")) find_stars_avx2  (g->data, s, words);
+  else if (__builtin_cpu_supports("sse2")) find_stars_sse2  (g->data, s, words);
+  else                                     find_stars_scalar(g->data, s, words);
+#else
+  find_stars_scalar(g->data, s, words);
+#endif
+  for (int k = 0; k < words; k++) {
+    Uint64 prev  = k > 0         ? s[k - 1] & ~g->east[k - 1] : 0;
+    Uint64 next  = k < words - 1 ? s[k + 1] & ~g->west[k + 1] : 0;
+    Uint64 east  = (s[k] & ~g->east[k]) << 1 | prev >> 63;  // right of a star
+    Uint64 west  = (s[k] & ~g->west[k]) >> 1 | next << 63;  // left of a star
+    Uint64 south = 0, north = 0;                            // below, above a star
+    if (k - q     >= 0)          south |= s[k - q]     << r;
+    if (k - q - 1 >= 0    && r)  south |= s[k - q - 1] >> (64 - r);
+    if (k + q     <  words)      north |= s[k + q]     >> r;
+    if (k + q + 1 <  words && r) north |= s[k + q + 1] << (64 - r);
+    g->bang[k] = east | west | south | north;
+  }
+}
+
+void
+find_stars_scalar(const Uint8* data, Uint64* star, int words)
+{
+  for (int k = 0; k < words; k++) {
+    Uint64 bits = 0;
+    for (int b = 0; b < 64; b++)
+      bits |= (Uint64)(data[k * 64 + b] == '*') << b;
+    star[k] = bits;
+  }
+}
+
+#ifdef SIMD_X86
+__attribute__((target("sse2")))
+void
+find_stars_sse2(const Uint8* data, Uint64* star, int words)
+{
+  __m128i bang = _mm_set1_epi8('*');
+  for (int k = 0; k < words; k++) {
+    Uint64 bits = 0;
+    for (int b = 0; b < 4; b++) {
+      __m128i v = _mm_load_si128((const __m128i*)(data + k * 64 + b * 16));
+      bits |= (Uint64)(unsigned short)_mm_movemask_epi8(_mm_cmpeq_epi8(v, bang)) << (b * 16);
+    }
+    star[k] = bits;
+  }
+}
+
+__attribute__((target("avx2")))
+void
+find_stars_avx2(const Uint8* data, Uint64* star, int words)
+{
+  __m256i bang = _mm256_set1_epi8('*');
+  for (int k = 0; k < words; k++) {
+    __m256i lo = _mm256_load_si256((const __m256i*)(data + k * 64));
+    __m256i hi = _mm256_load_si256((const __m256i*)(data + k * 64 + 32));
+    star[k] = (Uint64)(Uint)_mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, bang)) |
+              (Uint64)(Uint)_mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, bang)) << 32;
+  }
+}
+#else
+void find_stars_sse2(const Uint8* data, Uint64* star, int words) { find_stars_scalar(data, star, words); }
+void find_stars_avx2(const Uint8* data, Uint64* star, int words) { find_stars_scalar(data, star, words); }
+#endif
+
+void
+operate(Grid* g, int x, int y, char op)
+{
+  set_type(g, x, y, Operator);
+  if (ops[(Uint8)op].fn) ops[(Uint8)op].fn(g, x, y, op);
+  else                   printf("Unknown operator[%d,%d]: %c\n", x, y, op);
+}
+
+// add(a b); Outputs sum of inputs.
+void
+op_a(Grid* g, int x, int y, char c)
+{
+  bool fast = inside(g, x - 1, y, x + 1, y + 1);
+  char a = read_port(g, x - 1, y, false, fast);
+  char b = read_port(g, x + 1, y, true, fast);
+  write_port(g, x, y + 1, cchr(cb36(a) + cb36(b), b), fast);
+}
+
+// subtract(a b); Outputs difference of inputs.
+void
+op_b(Grid* g, int x, int y, char c)
+{
+  bool fast = inside(g, x - 1, y, x + 1, y + 1);
+  char a = read_port(g, x - 1, y, false, fast);
+  char b = read_port(g, x + 1, y, true, fast);
+  write_port(g, x, y + 1, cchr(cb36(a) - cb36(b), b), fast);
+}
+
+// clock(rate mod); Outputs modulo of frame.
+void
+op_c(Grid* g, int x, int y, char c)
+{
+  bool fast  = inside(g, x - 1, y, x + 1, y + 1);
+  char rate  = read_port(g, x - 1, y, false, fast);
+  char mod   = read_port(g, x + 1, y, true, fast);
+  int  mod_  = cb36(mod);  if (!mod_)  mod_  = 8;
+  int  rate_ = cb36(rate); if (!rate_) rate_ = 1;
+  clocked(g, rate_ * mod_);
+  write_port(g, x, y + 1, cchr(g->frame / rate_ % mod_, mod), fast);
+}
+
+// delay(rate mod); Bangs on modulo of frame.
+void
+op_d(Grid* g, int x, int y, char c)
+{
+  bool fast  = inside(g, x - 1, y, x + 1, y + 1);
+  char rate  = read_port(g, x - 1, y, false, fast);
+  char mod   = read_port(g, x + 1, y, true, fast);
+  int  rate_ = cb36(rate); if (!rate_) rate_ = 1;
+  int  mod_  = cb36(mod);  if (!mod_)  mod_  = 8;
+  clocked(g, rate_ * mod_);
+  write_port(g, x, y + 1, g->frame % (rate_ * mod_) == 0 ? '*' : '.', fast);
+}
+
+// east; Moves eastward, or bangs.
+void
+op_e(Grid* g, int x, int y, char c)
+{
+  if (x >= g->width - 1 || get_cell(g, x + 1, y) != '.')
+    set_cell(g, x, y, '*');
+  else {
+    set_cell(g, x    , y, '.');
+    set_port(g, x + 1, y,  c);
+    set_type(g, x + 1, y,  NoOp);
+  }
+  set_type(g, x, y, NoOp);
+}
+
+// if(a b); Bangs if inputs are equal.
+void
+op_f(Grid* g, int x, int y, char c)
+{
+  bool fast = inside(g, x - 1, y, x + 1, y + 1);
+  char a = read_port(g, x - 1, y, false, fast);
+  char b = read_port(g, x + 1, y, true, fast);
+  write_port(g, x, y + 1, a == b ? '*' : '.', fast);
+}
+
+// generator(x y len); Writes operands with offset.
+void
+op_g(Grid* g, int x, int y, char c)
+{
+  char px   = get_port(g, x - 3, y, false);
+  char py   = get_port(g, x - 2, y, false);
+  char len  = get_port(g, x - 1, y, false);
+  int  len_ = cb36(len); if (!len_) len_ = 1;
+  int  ox   = x + cb36(px);
+  int  oy   = y + 1 + cb36(py);
+  bool fast = inside(g, x + 1, y, x + len_, y) && inside(g, ox, oy, ox + len_ - 1, oy);
+  for (int i = 0; i < len_; i++)
+    write_port(g, ox + i, oy, read_port(g, x + 1 + i, y, true, fast), fast);
+}
+
+// halt; Halts southward operand.
+void
+op_h(Grid* g, int x, int y, char c)
+{
+  get_port(g, x, y + 1, true);
+}
+
+// increment(step mod); Increments southward operand.
+void
+op_i(Grid* g, int x, int y, char c)
+{
+  bool fast  = inside(g, x - 1, y, x + 1, y + 1);
+  char rate  = read_port(g, x - 1, y    , false, fast);
+  char mod   = read_port(g, x + 1, y    , true, fast);
+  char val   = read_port(g, x    , y + 1, true, fast);
+  int  rate_ = cb36(rate); if (!rate_) rate_ = 1;
+  int  mod_  = cb36(mod);  if (!mod_)  mod_  = N_VARS;
+  write_port(g, x, y + 1, cchr((cb36(val) + rate_) % mod_, mod), fast);
+}
+
+// jumper(val); Outputs northward operand.
+void
+op_j(Grid* g, int x, int y, char c)
+{
+  char link = get_port(g, x, y - 1, false);
+  if (link != c) {
+    int i;
+    for (i = 1; y + i < g->height; i++)
+      if (get_cell(g, x, y + i) != c) break;
+    set_port(g, x, y + i, link);
+  }
+}
+
+// konkat(len); Reads multiple variables.
+void
+op_k(Grid* g, int x, int y, char c)
+{
+  char len  = get_port(g, x - 1, y, false);
+  int  len_ = cb36(len); if (!len_) len_ = 1;
+  bool fast = inside(g, x + 1, y, x + len_, y + 1);
+  for (int i = 0; i < len_; i++) {
+    char key =      read_port (g, x + 1 + i, y    , true, fast);
+    if (key != '.') write_port(g, x + 1 + i, y + 1, get_var(g, cb36(key)), fast);
+  }
+}
+
+// less(a b); Outputs smallest of inputs.
+void
+op_l(Grid* g, int x, int y, char c)
+{
+  bool fast = inside(g, x - 1, y, x + 1, y + 1);
+  char a = read_port(g, x - 1, y, false, fast);
+  char b = read_port(g, x + 1, y, true, fast);
+  write_port(g, x, y + 1, cb36(a) < cb36(b) ? a : b, fast);
+}
+
+// multiply(a b); Outputs product of inputs.
+void
+op_m(Grid* g, int x, int y, char c)
+{
+  bool fast = inside(g, x - 1, y, x + 1, y + 1);
+  char a = read_port(g, x - 1, y, false, fast);
+  char b = read_port(g, x + 1, y, true, fast);
+  write_port(g, x, y + 1, cchr(cb36(a) * cb36(b), b), fast);
+}
+
+// north; Moves Northward, or bangs.
+void
+op_n(Grid* g, int x, int y, char c)
+{
+  if (y <= 0 || get_cell(g, x, y - 1) != '.')
+    set_cell(g, x, y    , '*');
+  else {
+    set_cell(g, x, y    , '.');
+    set_port(g, x, y - 1,  c);
+    set_type(g, x, y - 1,  NoOp);
+  }
+  set_type(g, x, y, NoOp);
+}
+
+// read(x y read); Reads operand with offset.
+void
+op_o(Grid* g, int x, int y, char c)
+{
+  char px = get_port(g, x - 2, y, false);
+  char py = get_port(g, x - 1, y, false);
+  set_port(g, x, y + 1, get_port(g, x + 1 + cb36(px), y + cb36(py), true));
+}
+
+// push(len key val); Writes eastward operand.
+void
+op_p(Grid* g, int x, int y, char c)
+{
+  char key  = get_port(g, x - 2, y, false);
+  char len  = get_port(g, x - 1, y, false);
+  char val  = get_port(g, x + 1, y, true);
+  int  len_ = cb36(len); if (!len_) len_ = 1;
+  bool fast = inside(g, x, y + 1, x + len_ - 1, y + 1);
+  for (int i = 0; i < len_; i++)
+    fast ? poke_lock(g, x + i, y + 1) : set_lock(g, x + i, y + 1);  // can only be values not operators
+  write_port(g, x + (cb36(key) % len_), y + 1, val, fast);
+}
+
+// query(x y len); Reads operands with offset.
+void
+op_q(Grid* g, int x, int y, char c)
+{
+  char px   = get_port(g, x - 3, y, false);
+  char py   = get_port(g, x - 2, y, false);
+  char len  = get_port(g, x - 1, y, false);
+  int  len_ = cb36(len); if (!len_) len_ = 1;
+  int  ix   = x + 1 + cb36(px);
+  int  iy   = y + cb36(py);
+  bool fast = inside(g, ix, iy, ix + len_ - 1, iy) && inside(g, x + 1 - len_, y + 1, x, y + 1);
+  for (int i = 0; i < len_; i++)
+    write_port(g, x + 1 - len_ + i, y + 1, read_port(g, ix + i, iy, true, fast), fast);
+}
+
+// random(min max); Outputs random value.
+void
+op_r(Grid* g, int x, int y, char c)
+{
+  bool fast = inside(g, x - 1, y, x + 1, y + 1);
+  char min  = read_port(g, x - 1, y, false, fast);
+  char max  = read_port(g, x + 1, y, true, fast);
+  int  max_ = cb36(max); if (!max_)        max_ = N_VARS;
+  int  min_ = cb36(min); if (min_ == max_) min_ = max_ - 1;
+  Uint key  = (g->random + y * g->width + x) ^ (g->frame << 16);  // the low 16 bits of frame
+  clocked(g, 1 << 16);
+  key = (key ^ 61U) ^ (key >> 16);
+  key =  key + (key << 3);
+  key =  key ^ (key >> 4);
+  key =  key * 0x27d4eb2d;
+  key =  key ^ (key >> 15);
+  write_port(g, x, y + 1, cchr(key % (max_ - min_) + min_, max), fast);
+}
+
+// south; Moves southward, or bangs.
+void
+op_s(Grid* g, int x, int y, char c)
+{
+  if (y >= g->height - 1 || get_cell(g, x, y + 1) != '.')
+    set_cell(g, x, y    , '*');
+  else {
+    set_cell(g, x, y    , '.');
+    set_port(g, x, y + 1,  c);
+    set_type(g, x, y + 1,  NoOp);
+  }
+  set_type(g, x, y, NoOp);
+}
+
+// track(key len val); Reads eastward operand.
+void
+op_t(Grid* g, int x, int y, char c)
+{
+  char key  = get_port(g, x - 2, y, false);
+  char len  = get_port(g, x - 1, y, false);
+  int  len_ = cb36(len); if (!len_) len_ = 1;
+  bool fast = inside(g, x, y, x + len_, y + 1);
+  for (int i = 0; i < len_; i++)
+    fast ? poke_lock(g, x + 1 + i, y) : set_lock(g, x + 1 + i, y);  // can only be values not operators
+  write_port(g, x, y + 1, read_port(g, x + 1 + (cb36(key) % len_), y, true, fast), fast);
+}
+
+// uclid(step max); Bangs on Euclidean rhythm.
+void
+op_u(Grid* g, int x, int y, char c)
+{
+  bool fast   = inside(g, x - 1, y, x + 1, y + 1);
+  char step   = read_port(g, x - 1, y, false, fast);
+  char max    = read_port(g, x + 1, y, true, fast);
+  int  step_  = cb36(step); if (!step_) step_ = 1;
+  int  max_   = cb36(max);  if (!max_)  max_  = 8;
+  int  bucket = (step_ * (g->frame + max_ - 1)) % max_ + step_;
+  clocked(g, max_);
+  write_port(g, x, y + 1, bucket >= max_ ? '*' : '.', fast);
+}
+
+// variable(write read); Reads and writes variable.
+void
+op_v(Grid* g, int x, int y, char c)
+{
+  bool fast = inside(g, x - 1, y, x + 1, y + 1);
+  char w = read_port(g, x - 1, y, false, fast);
+  char r = read_port(g, x + 1, y, true, fast);
+  if      (w != '.')             set_var(g, cb36(w), r);
+  else if (w == '.' && r != '.') write_port(g, x, y + 1, get_var(g, cb36(r)), fast);
+}
+
+// west; Moves westward, or bangs.
+void
+op_w(Grid* g, int x, int y, char c)
+{
+  if (x <= 0 || get_cell(g, x - 1, y) != '.')
+    set_cell(g, x    , y, '*');
+  else {
+    set_cell(g, x    , y, '.');
+    set_port(g, x - 1, y,  c);
+    set_type(g, x - 1, y,  NoOp);
+  }
+  set_type(g, x, y, NoOp);
+}
+
+// write(x y val); Writes operand with offset.
+void
+op_x(Grid* g, int x, int y, char c)
+{
+  char px  = get_port(g, x - 2, y, false);
+  char py  = get_port(g, x - 1, y, false);
+  char val = get_port(g, x + 1, y, true);
+  set_port(g, x + cb36(px), y + cb36(py) + 1, val);
+}
+
+// jymper(val); Outputs westward operand.
+void
+op_y(Grid* g, int x, int y, char c)
+{
+  int i;
+  char link = get_port(g, x - 1, y, false);
+  if (link != c) {
+    for (i = 1; x + i < g->width; i++)
+      if (get_cell(g, x + i, y) != c) break;
+    set_port(g, x + i, y, link);
+  }
+}
+
+// lerp(rate target); Transitions operand to input.
+void
+op_z(Grid* g, int x, int y, char c)
+{
+  bool fast    = inside(g, x - 1, y, x + 1, y + 1);
+  char rate    = read_port(g, x - 1, y    , false, fast);
+  char target  = read_port(g, x + 1, y    , true, fast);
+  char val     = read_port(g, x    , y + 1, true, fast);
+  int  rate_   = cb36(rate); if (!rate_) rate_ = 1;
+  int  target_ = cb36(target);
+  int  val_    = cb36(val);
+  int  mod     = val_ <= target_ - rate_ ?  rate_ : 
+                 val_ >= target_ + rate_ ? -rate_ : target_ - val_;
+  write_port(g, x, y + 1, cchr(val_ + mod, target), fast);
+}
+
+// bang; Bangs neighboring operands.
+void
+op_bang(Grid* g, int x, int y, char c)
+{
+  set_cell(g, x, y, '.');
+}
+
+// comment; Halts a line.
+void
+op_comment(Grid* g, int x, int y, char c)
+{
+  for (int i = 1; x + i < g->width; i++) {
+    set_lock(g, x + i, y);  // deactivate cells
+    if (get_cell(g, x + i, y) == '#') break;
+  }
+  set_type(g, x, y, Comment);
+}
+
+// midi; Sends a MIDI note.
+void
+op_midi(Grid* g, int x, int y, char c)
+{
+  bool fast    = inside(g, x + 1, y, x + 5, y);
+  int channel  = cb36(read_port(g, x + 1, y, true, fast)); if (channel     == '.') return;
+  int octave   = cb36(read_port(g, x + 2, y, true, fast)); if (octave      == '.') return;
+  int note     =      read_port(g, x + 3, y, true, fast);  if (cisp(note))         return;
+  int velocity =      read_port(g, x + 4, y, true, fast);  if (velocity    == '.') velocity = 'z';
+  int length   =      read_port(g, x + 5, y, true, fast);
+  if (bangged(g, x, y)) {
+    if (g->midi)
+      g->midi(g->midi_arg,
+              clamp(channel, 0, VOICES - 1),
+              12 * octave + ctbl(note),
+              clamp(cb36(velocity), 0, N_VARS),
+              clamp(cb36(length),   1, N_VARS));
+    set_type(g, x, y, Operator);
+  } else
+    set_type(g, x, y, LeftInput);
+}
+
+// ==============================================================================  
+// ============================== Helper Functions ==============================  
+// ==============================================================================  
+
+int
+clamp(int val, int min, int max)
+{
+  return (val >= min) ? ((val <= max) ? val : max) : min;
+}
+
+// 256-entry lookup tables indexed by the cell byte, filled at compile time
+// from the same expressions the helpers used to evaluate on every call
+#define T4(f, n)   f(n), f(n + 1), f(n + 2), f(n + 3)
+#define T16(f, n)  T4(f, n), T4(f, n + 4), T4(f, n + 8), T4(f, n + 12)
+#define T64(f, n)  T16(f, n), T16(f, n + 16), T16(f, n + 32), T16(f, n + 48)
+#define T256(f)    T64(f, 0), T64(f, 64), T64(f, 128), T64(f, 192)
+
+#define DIGIT(c)   ((c) >= '0' && (c) <= '9')
+#define UPPER(c)   ((c) >= 'A' && (c) <= 'Z')
+#define LOWER(c)   ((c) >= 'a' && (c) <= 'z')
+#define SPECIAL(c) ((c) == '.' || (c) == ':' || (c) == '#' || (c) == '*')
+#define B36(c)     (DIGIT(c) ? (c) - '0' : UPPER(c) ? (c) - 'A' + 10 : LOWER(c) ? (c) - 'a' + 10 : 0)
+#define UCA(c)     (LOWER(c) ? (c) - 'a' + 'A' : (c))
+#define LCA(c)     (UPPER(c) ? (c) - 'A' + 'a' : (c))
+#define VALID(c)   (B36(c) || (c) == '0' || SPECIAL(c))
+#define DEG(u)     ((u) <= 'B' ? 'G' - 'B' + (u) - 'A' : (u) - 'C')
+#define SEMI(d)    ((d) % 7 == 0 ? 0 : (d) % 7 == 1 ? 2 : (d) % 7 == 2 ? 4 : (d) % 7 == 3 ? 5 : (d) % 7 == 4 ? 7 : (d) % 7 == 5 ? 9 : 11)
+#define NOTE(u)    (DEG(u) / 7 * 12 + SEMI(DEG(u)))
+#define TBL(c)     (DIGIT(c) ? (c) - '0' : UPPER(c) ? NOTE(c) : LOWER(c) ? NOTE(UCA(c)) + 1 : 0)
+
+static const bool  cisp_tbl[256]  = { T256(SPECIAL) };
+static const Uint8 cb36_tbl[256]  = { T256(B36) };
+static const Uint8 cuca_tbl[256]  = { T256(UCA) };
+static const Uint8 clca_tbl[256]  = { T256(LCA) };
+static const bool  valid_tbl[256] = { T256(VALID) };
+static const bool  upper_tbl[256] = { T256(UPPER) };
+static const Uint8 ctbl_tbl[256]  = { T256(TBL) };  // 0 for bytes that are not digits or letters
+
+// cchr results for -N_VARS <= v < 2 * N_VARS, the range sums, differences and
+// increments of two base-36 values fall in: [upper][v + N_VARS]
+static const char cchr_tbl[2][3 * N_VARS] = {
+  "0zyxwvutsrqponmlkjihgfedcba987654321" "0123456789abcdefghijklmnopqrstuvwxyz" "0123456789abcdefghijklmnopqrstuvwxyz",
+  "0ZYXWVUTSRQPONMLKJIHGFEDCBA987654321" "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ" "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ",
+};
+
+// is c special character?
+bool
+cisp(char c)
+{
+  return cisp_tbl[(Uint8)c];
+}
+
+// int 'v' to char
+// result has same case as 'c'
+char
+cchr(int v, char c)
+{
+  if (v < -N_VARS || v >= 2 * N_VARS) v = abs(v % N_VARS);
+  return cchr_tbl[upper_tbl[(Uint8)c]][v + N_VARS];
+}
+
+// char to 0 <= int <= 35
+int
+cb36(char c)
+{
+  return cb36_tbl[(Uint8)c];
+}
+
+// to upper-case
+char
+cuca(char c)
+{
+  return cuca_tbl[(Uint8)c];
+}
+
+// to lower-case
+char
+clca(char c)
+{
+  return clca_tbl[(Uint8)c];
+}
+
+char
+cinc(char c)
+{
+  return cisp(c) ? c : cchr(cb36(c) + 1, c);
+}
+
+char
+cdec(char c)
+{
+  return cisp(c) ? c : cchr(cb36(c) - 1, c);
+}
+
+bool
+valid_position(Grid* g, int x, int y)
+{
+  return x >= 0 && x <= g->width - 1 && y >= 0 && y <= g->height - 1;
+}
+
+bool
+valid_character(char c)
+{
+  return valid_tbl[(Uint8)c];
+}
+
+// char to note (used in op_midi)
+int
+ctbl(char c)
+{
+  return ctbl_tbl[(Uint8)c];
+}
+
+// string copy; len includes zero-terminal
+char*
+scpy(char* src, char* dst, int len)
+{
+  int i = 0;
+  while ((dst[i] = src[i]) && i < len - 2) i++;
+  dst[i + 1] = '\0';
+  return dst;
+}
+
+char
+get_cell(Grid* g, int x, int y)
+{
+  if (valid_position(g, x, y)) return peek_cell(g, x, y);
+  return '.';
+}
+
+void
+set_cell(Grid* g, int x, int y, char c)
+{
+  if (valid_position(g, x, y) && valid_character(c))
+    poke_cell(g, x, y, c);
+}
+
+// true when the rectangle (x0, y0)-(x1, y1) lies on the grid
+bool
+inside(Grid* g, int x0, int y0, int x1, int y1)
+{
+  return x0 >= 0 && y0 >= 0 && x1 < g->width && y1 < g->height;
+}
+
+Type
+get_type(Grid* g, int x, int y)
+{
+  if (valid_position(g, x, y))
+    return g->meta[x + (y * g->width)] & TYPE;
+  return NoOp;
+}
+
+// set cell's coloring
+void
+set_type(Grid* g, int x, int y, Type type)
+{
+  if (valid_position(g, x, y))
+    g->meta[x + (y * g->width)] = (g->meta[x + (y * g->width)] & LOCK) | type;
+}
+
+// deactivate cell (cell contains number/value but not operator)
+void
+set_lock(Grid* g, int x, int y)
+{
+  if (valid_position(g, x, y)) poke_lock(g, x, y);
+}
+
+// set operator's output
+void
+set_port(Grid* g, int x, int y, char c)
+{
+  if (valid_position(g, x, y))
+    g->meta[x + (y * g->width)] = LOCK | Output;  // output is a value; will not turn into an operator
+  set_cell(g, x, y, c);
+}
+
+// get operator's input
+int
+get_port(Grid* g, int x, int y, bool lock)
+{
+  if (!valid_position(g, x, y)) return '.';
+  return peek_port(g, x, y, lock);  // lock: right-hand side of operator cannot be an operator
+}
+
+// ---------- unchecked: (x, y) must be on the grid, c a valid character ----------
+
+char
+peek_cell(Grid* g, int x, int y)
+{
+  int i = x + (y * g->width);
+  TRACK(g, i);
+  return g->data[i];
+}
+
+void
+poke_cell(Grid* g, int x, int y, char c)
+{
+  int i = x + (y * g->width);
+  g->data[i] = c;
+  if (ops[(Uint8)c].fn) g->active[i / 64] |=   1ULL << (i % 64);
+  else                  g->active[i / 64] &= ~(1ULL << (i % 64));
+  if (c == '*')         mark_bang(g, x, y);
+}
+
+void
+poke_lock(Grid* g, int x, int y)
+{
+  Uint8* m = &g->meta[x + (y * g->width)];
+  *m = (*m & TYPE) == NoOp ? *m | LOCK : LOCK | Comment;
+}
+
+void
+poke_port(Grid* g, int x, int y, char c)
+{
+  g->meta[x + (y * g->width)] = LOCK | Output;
+  poke_cell(g, x, y, c);
+}
+
+int
+peek_port(Grid* g, int x, int y, bool lock)
+{
+  int i = x + (y * g->width);
+  if (lock) g->meta[i] = LOCK | RightInput;
+  else      g->meta[i] = (g->meta[i] & LOCK) | LeftInput;
+  return g->data[i];
+}
+
+// port access for operators: unchecked when 'fast' (footprint already checked by inside())
+int
+read_port(Grid* g, int x, int y, bool lock, bool fast)
+{
+  return fast ? peek_port(g, x, y, lock) : get_port(g, x, y, lock);
+}
+
+void
+write_port(Grid* g, int x, int y, char c, bool fast)
+{
+  if (fast) poke_port(g, x, y, c);
+  else      set_port (g, x, y, c);
+}
+
+Uint8
+get_var(Grid* g, int k)
+{
+  if (g->band) g->band->read_vars |= 1ULL << k;
+  return g->vars[k];
+}
+
+void
+set_var(Grid* g, int k, Uint8 v)
+{
+  if (g->band) g->band->put_vars |= 1ULL << k;
+  g->vars[k] = v;
+}
+
+bool
+bangged(Grid* g, int x, int y)
+{
+  return get_cell(g, x - 1, y    ) == '*' ||
+         get_cell(g, x + 1, y    ) == '*' ||
+         get_cell(g, x    , y - 1) == '*' ||
+         get_cell(g, x    , y + 1) == '*';
+}
+
+// flag the four neighbours of a new '*' in the bang bitmap
+void
+mark_bang(Grid* g, int x, int y)
+{
+  int d[4][2] = { { -1, 0 }, { 1, 0 }, { 0, -1 }, { 0, 1 } };
+  for (int k = 0; k < 4; k++) {
+    int x_ = x + d[k][0], y_ = y + d[k][1], i = x_ + y_ * g->width;
+    if (valid_position(g, x_, y_)) g->bang[i / 64] |= 1ULL << (i % 64);
+  }
+}
+
+// bits of bitmap word w that lie in cells [from, to)
+Uint64
+span(int w, int from, int to)
+{
+  Uint64 mask = ~0ULL;
+  if (w == from / 64)     mask &= ~0ULL << (from % 64);
+  if (w == (to - 1) / 64) mask &= ~0ULL >> (63 - (to - 1) % 64);
+  return mask;
+}
+
+// least common multiple, 0 past SEEK_PERIOD; 0 stays 0
+int
+lcm(int a, int b)
+{
+  if (!a || !b) return 0;
+  int x = a, y = b;
+  while (y) { int r = x % y; x = y; y = r; }
+  long long m = (long long)a / x * b;
+  return m > SEEK_PERIOD ? 0 : m;
+}
+
+// an operator used frame only through frame % period
+void
+clocked(Grid* g, int period)
+{
+  if (g->period && g->period % period) g->period = lcm(g->period, period);
+}
+
+// hash of data and vars, eight cells at a time
+Uint64
+hash_grid(Grid* g)
+{
+  Uint64 h = 0x9e3779b97f4a7c15ULL, w;
+  for (int i = 0; i < g->length; i += 8) {
+    w = 0;
+    memcpy(&w, g->data + i, g->length - i < 8 ? g->length - i : 8);
+    h = (h ^ w) * 0xff51afd7ed558ccdULL;
+    h ^= h >> 32;
+  }
+  for (int k = 0; k < N_VARS; k++) h = (h ^ g->vars[k]) * 0x100000001b3ULL;
+  return h;
+}
+
+// size rounded up to a whole number of cache lines
+size_t
+align(size_t size)
+{
+  return (size + LINE - 1) / LINE * LINE;
+}
+
+bool
+error(char* msg, const char* err)
+{
+  printf("Error %s: %s\n", msg, err);
+  return false;
+}
+
+// ==================================================================
+// ============================== MIDI ==============================
+// ==================================================================
+
+// Starts a render of g's notes into 'name'.  A frame is a quarter note, so
+// the tempo is the BPM keiko steps at; the track length is filled in by
+// close_smf.
+bool
+open_smf(Smf* s, char* name, Grid* g, int bpm)
+{
+  static const Uint8 head[] = { 'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, SMF_DIVISION >> 8, SMF_DIVISION & 0xff,
+                                'M', 'T', 'r', 'k', 0, 0, 0, 0 };
+  Uint us = 60000000 / bpm;  // per quarter note
+  Uint8 tempo[] = { 0, 0xff, 0x51, 3, us >> 16, us >> 8, us };
+  *s = (Smf){ .grid = g, .bpm = bpm };
+  if (!(s->file = fopen(name, "wb"))) return error("Render", "Cannot open output file");
+  fwrite(head, 1, sizeof head, s->file);
+  smf_write(s, tempo, sizeof tempo);
+  return true;
+}
+
+// MidiFn: plays a note now, for 'length' frames; velocity and length as
+// send_midi takes them.  A note already sounding is released first.
+void
+smf_note(void* arg, int channel, int value, int velocity, int length)
+{
+  Smf* s   = arg;
+  Uint now = (Uint)s->grid->frame * SMF_DIVISION;
+  value    = clamp(value, 0, 127);
+  smf_release(s, now);
+  for (int i = 0; i < s->n_voices; i++)
+    if (s->voices[i].channel == channel && s->voices[i].value == value) {
+      smf_event(s, now, 0x80 + channel, value, 0);
+      s->voices[i--] = s->voices[--s->n_voices];
+    }
+  if (s->n_voices == SMF_POLY) {  // end the note that ends first
+    int k = 0;
+    for (int i = 1; i < s->n_voices; i++)
+      if (s->voices[i].off < s->voices[k].off) k = i;
+    smf_event(s, now, 0x80 + s->voices[k].channel, s->voices[k].value, 0);
+    s->voices[k] = s->voices[--s->n_voices];
+  }
+  smf_event(s, now, 0x90 + channel, value, clamp(velocity * 3, 1, 127));
+  s->voices[s->n_voices++] = (Voice){ channel, value, now + length * SMF_DIVISION };
+  s->notes++;
+}
+
+// note-offs of every voice ending by 'tick', in time order
+void
+smf_release(Smf* s, Uint tick)
+{
+  while (s->n_voices) {
+    int k = 0;
+    for (int i = 1; i < s->n_voices; i++)
+      if (s->voices[i].off < s->voices[k].off) k = i;
+    if (s->voices[k].off > tick) return;
+    smf_event(s, s->voices[k].off, 0x80 + s->voices[k].channel, s->voices[k].value, 0);
+    s->voices[k] = s->voices[--s->n_voices];
+  }
+}
+
+// a channel event at 'tick', which is no earlier than the last one
+void
+smf_event(Smf* s, Uint tick, int status, int a, int b)
+{
+  Uint8 bytes[8];
+  int   n = 0, shift = 21;
+  Uint  d = tick - s->tick;  // delta time: 7 bits a byte, most significant first, high bit = more
+  while (shift > 0 && !(d >> shift)) shift -= 7;
+  for (; shift > 0; shift -= 7) bytes[n++] = 0x80 | (d >> shift & 0x7f);
+  bytes[n++] = d & 0x7f;
+  bytes[n++] = status;
+  bytes[n++] = a;
+  bytes[n++] = b;
+  s->tick    = tick;
+  smf_write(s, bytes, n);
+}
+
+void
+smf_write(Smf* s, const Uint8* bytes, int n)
+{
+  fwrite(bytes, 1, n, s->file);
+  s->size += n;
+}
+
+// releases the notes still sounding, ends the track and fills in its length
+bool
+close_smf(Smf* s)
+{
+  static const Uint8 end[] = { 0, 0xff, 0x2f, 0 };
+  smf_release(s, (Uint)-1);
+  smf_write(s, end, sizeof end);
+  Uint8 size[] = { s->size >> 24, s->size >> 16, s->size >> 8, s->size };
+  bool  ok     = !fseek(s->file, 18, SEEK_SET) && fwrite(size, 1, 4, s->file) == 4;
+  ok = !fclose(s->file) && ok;
+  s->file = NULL;
+  return ok ? true : error("Render", "Cannot write output file");
+}
+
+// A table of 'size' voices, none sounding.  Allocates: call it before the
+// player's realtime thread starts; the rest of these never allocate.
+bool
+init_voices(Voices* v, int size)
+{
+  Voices n = { .size = size, .first = -1, .last = -1 };
+  n.note = malloc(size * sizeof *n.note);
+  n.prev = malloc(size * sizeof *n.prev);
+  n.next = malloc(size * sizeof *n.next);
+  if (!n.note || !n.prev || !n.next) { free_voices(&n); return error("Voices", "Failed to allocate memory"); }
+  for (int i = 0; i < size; i++) n.next[i] = i + 1 < size ? i + 1 : -1;
+  memset(n.held, 0xff, sizeof n.held);  // -1
+  free_voices(v);
+  *v = n;
+  return true;
+}
+
+void
+free_voices(Voices* v)
+{
+  free(v->note);
+  free(v->prev);
+  free(v->next);
+  v->note = NULL;
+  v->prev = v->next = NULL;
+}
+
+// a free voice, now the newest sounding; -1 = none
+int
+take_voice(Voices* v)
+{
+  int i = v->free;
+  if (i < 0) return -1;
+  v->free    = v->next[i];
+  v->prev[i] = v->last;
+  v->next[i] = -1;
+  if (v->last >= 0) v->next[v->last] = i;
+  else              v->first         = i;
+  v->last = i;
+  v->count++;
+  return i;
+}
+
+void
+drop_voice(Voices* v, int i)
+{
+  MidiNote* n = &v->note[i];
+  if (v->prev[i] >= 0) v->next[v->prev[i]] = v->next[i];
+  else                 v->first            = v->next[i];
+  if (v->next[i] >= 0) v->prev[v->next[i]] = v->prev[i];
+  else                 v->last             = v->prev[i];
+  if (v->held[n->channel][n->value] == i) v->held[n->channel][n->value] = -1;
+  v->next[i] = v->free;
+  v->free    = i;
+  v->count--;
+}
+
+// Gives 'n' a voice.  The same note still sounding on its channel is cut
+// short to end where 'n' starts, so its note-off goes out first, as in Orca;
+// one that would not have started by then is dropped.  With 'limit' voices
+// sounding the oldest is stolen: it is silenced at the start of the period.
+void
+start_note(Voices* v, MidiNote* n, int limit, MidiEvent* ev, int* n_events)
+{
+  int i = v->held[n->channel][n->value];
+  if (i >= 0) {
+    MidiNote* old  = &v->note[i];
+    int       left = (int32_t)(n->time - old->time);
+    if      (old->trigger && left <= 0) drop_voice(v, i);
+    else if (old->length > left)        old->length = left > 0 ? left : 0;
+  }
+  while (v->count >= limit && (i = v->first) >= 0) {
+    MidiNote* old = &v->note[i];
+    if (!old->trigger) add_event(ev, n_events, 0, 0x80 + old->channel, old->value, 0);
+    drop_voice(v, i);
+  }
+  if ((i = take_voice(v)) < 0) return;
+  v->note[i]                    = *n;
+  v->held[n->channel][n->value] = i;
+}
+
+// The note-ons and note-offs due in the period of 'n_frames' from frame
+// 'start', each on the frame it is due at, or on the first one if it is
+// already late; voices ended are dropped.  Oldest first: a retriggered
+// note's note-off goes out before its successor's note-on.
+void
+play_voices(Voices* v, Uint start, Uint n_frames, MidiEvent* ev, int* n_events)
+{
+  for (int i = v->first, next; i >= 0; i = next) {
+    MidiNote* n  = &v->note[i];
+    int       on = (int32_t)(n->time - start);  // frames from period start; negative = late
+    next         = v->next[i];
+    if (on >= (int)n_frames) continue;
+    if (n->trigger) {
+      n->trigger = false;
+      add_event(ev, n_events, clamp(on, 0, n_frames - 1), 0x90 + n->channel, n->value, n->velocity);
+    }
+    int off = on + n->length;
+    if (off < (int)n_frames) {
+      add_event(ev, n_events, clamp(off, 0, n_frames - 1), 0x80 + n->channel, n->value, 0);
+      drop_voice(v, i);
+    }
+  }
+}
+
+// insert keeping ev[] sorted by offset; equal offsets keep their arrival order
+void
+add_event(MidiEvent* ev, int* n, Uint offset, int status, int value, int velocity)
+{
+  int i = (*n)++;
+  for (; i > 0 && ev[i - 1].offset > offset; i--) ev[i] = ev[i - 1];
+  ev[i] = (MidiEvent){ offset, { status, value, velocity } };
+}
+
+// =======================================================================
+// ============================== Scheduler ==============================
+// =======================================================================
+
+// start 'threads' pool threads; 0 is fine, run_grids then works alone
+bool
+init_pool(Pool* p, int threads)
+{
+  *p = (Pool){ .threads = calloc(threads ? threads : 1, sizeof(pthread_t)) };
+  if (!p->threads) return error("Pool", "Failed to allocate memory");
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->start, NULL);
+  pthread_cond_init(&p->done, NULL);
+  for (; p->n_threads < threads; p->n_threads++)
+    if (pthread_create(&p->threads[p->n_threads], NULL, pool_thread, p)) break;
+  return true;
+}
+
+void*
+pool_thread(void* arg)
+{
+  Pool* p    = arg;
+  Uint  seen = 0;
+  pthread_mutex_lock(&p->lock);
+  while (true) {
+    while (p->generation == seen && !p->quit) pthread_cond_wait(&p->start, &p->lock);
+    if (p->quit) break;
+    seen = p->generation;
+    pthread_mutex_unlock(&p->lock);
+    pool_work(p);
+    pthread_mutex_lock(&p->lock);
+    if (--p->busy == 0) pthread_cond_signal(&p->done);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+// claim parts of the job one at a time until none are left; the parts
+// share nothing, so any thread may run any of them
+void
+pool_work(Pool* p)
+{
+  int i;
+  while ((i = atomic_fetch_add_explicit(&p->next, 1, memory_order_relaxed)) < p->n_jobs)
+    p->job(p->arg, i);
+}
+
+// job(arg, i) for every i < n; returns when all are done.  Every pool thread
+// checks in once per job, so none can still be reading the last one.
+void
+run_job(Pool* p, JobFn job, void* arg, int n)
+{
+  pthread_mutex_lock(&p->lock);
+  p->job    = job;
+  p->arg    = arg;
+  p->n_jobs = n;
+  p->busy   = p->n_threads;
+  atomic_store_explicit(&p->next, 0, memory_order_relaxed);
+  p->generation++;
+  pthread_cond_broadcast(&p->start);
+  pthread_mutex_unlock(&p->lock);
+  pool_work(p);
+  pthread_mutex_lock(&p->lock);
+  while (p->busy) pthread_cond_wait(&p->done, &p->lock);
+  pthread_mutex_unlock(&p->lock);
+}
+
+// one frame of each grid
+void
+run_grids(Pool* p, Grid** grids, int n)
+{
+  run_job(p, run_grid_job, grids, n);
+}
+
+void
+run_grid_job(void* arg, int i)
+{
+  run_grid(((Grid**)arg)[i]);
+}
+
+void
+free_pool(Pool* p)
+{
+  pthread_mutex_lock(&p->lock);
+  p->quit = true;
+  pthread_cond_broadcast(&p->start);
+  pthread_mutex_unlock(&p->lock);
+  for (int i = 0; i < p->n_threads; i++) pthread_join(p->threads[i], NULL);
+  free(p->threads);
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->start);
+  pthread_cond_destroy(&p->done);
+}
+
+// =======================================================================
+// ================================ Bands ================================
+// =======================================================================
+
+// operator cells in row y of g
+int
+row_ops(Grid* g, int y)
+{
+  int n = 0;
+  for (int w = y * g->width / 64; w <= (y * g->width + g->width - 1) / 64; w++)
+    n += __builtin_popcountll(g->active[w] & span(w, y * g->width, (y + 1) * g->width));
+  return n;
+}
+
+// first row of a band: the one in [min, max], at most 8 rows from 'y', below
+// the row with the fewest operators; those write into the band and make it
+// re-run.  The nearest wins a tie.
+int
+band_start(Grid* g, int y, int min, int max)
+{
+  int best = clamp(y, min, max), ops = g->width + 1;
+  for (int d = 0; d <= 8; d++)
+    for (int s = -1; s <= 1; s += 2) {
+      int y_ = y + s * d;
+      if (y_ >= min && y_ <= max && row_ops(g, y_ - 1) < ops) { ops = row_ops(g, y_ - 1); best = y_; }
+    }
+  return best;
+}
+
+// n bands of whole rows over g, each with its own copy of the grid
+bool
+init_bands(Bands* t, Grid* g, int n)
+{
+  size_t words = WORDS(g->length);
+  n = clamp(n, 1, g->height);
+  *t = (Bands){ .n_bands = n, .grid = g };
+  t->bands   = calloc(n, sizeof *t->bands);
+  t->data0   = malloc(g->length);
+  t->active0 = malloc(words * sizeof(Uint64));
+  if (!t->bands || !t->data0 || !t->active0) { free_bands(t); return error("Bands", "Failed to allocate memory"); }
+  for (int k = 0, y0 = 0, y1; k < n; k++, y0 = y1) {
+    Band* b  = &t->bands[k];
+    y1       = k < n - 1 ? band_start(g, g->height * (k + 1) / n, y0 + 1, g->height - (n - 1 - k)) : g->height;
+    b->from  = y0 * g->width;
+    b->to    = y1 * g->width;
+    b->lo    = clamp(y0 - 1,     0, g->height) * g->width;
+    b->hi    = clamp(y1 + REACH, 0, g->height) * g->width;
+    b->stale = true;
+    memset(b->vars0, '.', N_VARS * sizeof *b->vars0);
+    if (!init_grid(&b->grid, g->width, g->height)) { free_bands(t); return false; }
+    if (!(b->seen = calloc(words, sizeof(Uint64)))) { free_bands(t); return error("Bands", "Failed to allocate memory"); }
+  }
+  return true;
+}
+
+// One frame of t->grid with its bands run in parallel, each on its own copy
+// as if it came first.  Then, in row order, every band whose reads an earlier
+// band changed is run again on the grid itself; the others have their
+// writes and notes copied over.  The result is exactly run_grid's.  The
+// bang bitmap is only needed for those re-runs, so it is built on the first.
+void
+run_bands(Pool* p, Bands* t)
+{
+  Grid* g     = t->grid;
+  bool  bangs = false;
+  memset(g->vars, '.', N_VARS * sizeof *g->vars);
+  g->period = 1;
+  memcpy(t->active0, g->active, WORDS(g->length) * sizeof(Uint64));
+  run_job(p, run_band, t, t->n_bands);
+  t->reruns = 0;
+  for (int k = 0; k < t->n_bands; k++) {
+    Band* b     = &t->bands[k];
+    bool  valid = band_valid(t, b);
+    memcpy(b->vars0, g->vars, N_VARS * sizeof *g->vars);  // what b will start from next frame, most likely
+    if (valid) { commit_band(t, b); continue; }
+    if (!bangs) { find_bangs(g); bangs = true; }
+    run_cells(g, b->from, b->to);
+    t->reruns++;
+  }
+  g->frame++;
+}
+
+// Pool job: band i clears the grid's meta in its rows, keeps their data for
+// band_valid, and runs them on its copy.  Only the copy's window is brought
+// up to date; nothing else was touched last frame unless the band was left
+// stale.  Only plain cell reads, operator cells and vars are tracked as they
+// happen; every port read or write and every lock leaves a non-NoOp meta on
+// the copy, which meta started the frame without, so those are collected
+// afterwards.
+void
+run_band(void* arg, int i)
+{
+  Bands* t     = arg;
+  Band*  b     = &t->bands[i];
+  Grid*  g     = t->grid;
+  Grid*  c     = &b->grid;
+  size_t words = WORDS(g->length);
+  int    lo    = b->stale ? 0 : b->lo;
+  int    hi    = b->stale ? g->length : b->hi;
+  int    w0    = lo / 64, w1 = (hi - 1) / 64;
+  memset(g->meta  + b->from, NoOp,          b->to - b->from);
+  memcpy(t->data0 + b->from, g->data + b->from, b->to - b->from);
+  memcpy(c->data   + lo, g->data   + lo, hi - lo);
+  memset(c->meta   + lo, NoOp,           hi - lo);
+  memcpy(c->active + w0, g->active + w0, (w1 - w0 + 1) * sizeof(Uint64));
+  memset(b->seen   + w0, 0,              (w1 - w0 + 1) * sizeof(Uint64));
+  memcpy(c->vars, b->vars0, N_VARS * sizeof *c->vars);
+  c->frame     = g->frame;
+  c->random    = g->random;
+  c->period    = 1;
+  c->midi      = band_midi;
+  c->midi_arg  = b;
+  c->band      = b;
+  b->read_vars = b->put_vars = 0;
+  b->n_notes   = 0;
+  b->lost      = false;
+  run_cells(c, b->from, b->to);
+
+  w0 = b->lo / 64, w1 = (b->hi - 1) / 64;
+  for (int k = w0; k <= w1; k++) {
+    Uint64 bits = 0, m;
+    for (int j = 0; j < 64; j += 8) {
+      memcpy(&m, c->meta + k * 64 + j, 8);  // eight cells; the plane is padded to a whole line
+      for (; m; m &= m - 1) bits |= 1ULL << (j + __builtin_ctzll(m) / 8);
+    }
+    b->seen[k] |= bits & span(k, b->lo, b->hi);
+  }
+  b->stale = false;  // an operator reached past the window (J can): b is re-run, its copy resynced
+  for (int k = 0; k < (int)words && !b->stale; k++)
+    b->stale = b->seen[k] & ~(k >= w0 && k <= w1 ? span(k, b->lo, b->hi) : 0);
+}
+
+// MidiFn of a band's copy: keep the note until the band is committed
+void
+band_midi(void* arg, int channel, int value, int velocity, int length)
+{
+  Band* b = arg;
+  if (b->n_notes == b->max_notes) {
+    int   max   = b->max_notes ? 2 * b->max_notes : 64;
+    Note* notes = realloc(b->notes, max * sizeof *notes);
+    if (!notes) { b->lost = true; return; }
+    b->notes     = notes;
+    b->max_notes = max;
+  }
+  b->notes[b->n_notes++] = (Note){ channel, value, velocity, length };
+}
+
+// True when b stayed inside its window and the grid, as the bands before b
+// left it, is as b assumed wherever b looked: the values of frame start, the
+// vars it started with, and the same operator cells in its rows.  Meta was
+// all NoOp to b.  Earlier bands may have set it where b left it NoOp (b only
+// read the value there) or ends up with an input or output lock, which comes
+// from overwriting meta whatever it held; but not on b's own operators,
+// whose lock decides whether they run.
+bool
+band_valid(Bands* t, Band* b)
+{
+  Grid* g = t->grid;
+  Grid* c = &b->grid;
+  if (b->lost || b->stale) return false;
+  for (int k = b->lo / 64; k <= (b->hi - 1) / 64; k++)
+    for (Uint64 bits = b->seen[k]; bits; bits &= bits - 1) {
+      int  i   = k * 64 + __builtin_ctzll(bits);
+      bool op  = i >= b->from && i < b->to && t->active0[k] >> (i % 64) & 1;
+      bool set = c->meta[i] == NoOp || c->meta[i] == (LOCK | RightInput) || c->meta[i] == (LOCK | Output);
+      if (g->data[i] != t->data0[i])          return false;
+      if (g->meta[i] != NoOp && (op || !set)) return false;
+    }
+  for (int k = 0; k < N_VARS; k++)
+    if (b->read_vars >> k & 1 && g->vars[k] != b->vars0[k]) return false;
+  for (int w = b->from / 64; b->from < b->to && w <= (b->to - 1) / 64; w++)
+    if ((g->active[w] ^ t->active0[w]) & span(w, b->from, b->to)) return false;
+  return true;
+}
+
+// copy the cells b saw into the grid and play its notes.  b wrote no cell
+// outside that set, and band_valid found the values there as b started on
+// them, so copying the ones b only read changes nothing; meta b left NoOp
+// it never wrote (or validated as NoOp), so that is kept.
+void
+commit_band(Bands* t, Band* b)
+{
+  Grid* g = t->grid;
+  Grid* c = &b->grid;
+  for (int k = b->lo / 64; k <= (b->hi - 1) / 64; k++)
+    for (Uint64 bits = b->seen[k]; bits; bits &= bits - 1) {
+      int i = k * 64 + __builtin_ctzll(bits);
+      if (g->data[i] != c->data[i]) poke_cell(g, i % g->width, i / g->width, c->data[i]);
+      if (c->meta[i] != NoOp) g->meta[i] = c->meta[i];
+    }
+  for (int k = 0; k < N_VARS; k++)
+    if (b->put_vars >> k & 1) g->vars[k] = c->vars[k];
+  g->period = lcm(g->period, c->period);
+  for (int i = 0; i < b->n_notes && g->midi; i++) {
+    Note* n = &b->notes[i];
+    g->midi(g->midi_arg, n->channel, n->value, n->velocity, n->length);
+  }
+}
+
+void
+free_bands(Bands* t)
+{
+  for (int k = 0; t->bands && k < t->n_bands; k++) {
+    free_grid(&t->bands[k].grid);
+    free(t->bands[k].seen);
+    free(t->bands[k].notes);
+  }
+  free(t->bands);
+  free(t->data0);
+  free(t->active0);
+  t->bands = NULL;
+}
+
+// =======================================================================
+// =============================== History ===============================
+// =======================================================================
+
+// a History of g's steps, keeping at most 'steps' of them and 'bytes' of
+// their cell changes; what g is now is where it starts
+bool
+init_history(History* h, Grid* g, size_t bytes, int steps)
+{
+  History n = { .size = bytes, .max_steps = steps };
+  n.ring    = malloc(bytes);
+  n.steps   = malloc(steps * sizeof *n.steps);
+  n.prev    = malloc(align(g->length));
+  n.scratch = malloc(bytes + 8);  // a change is at most 5 gap bytes and 2 characters
+  if (!n.ring || !n.steps || !n.prev || !n.scratch) { free_history(&n); return error("History", "Failed to allocate memory"); }
+  memcpy(n.prev, g->data, align(g->length));
+  get_stamp(g, &n.now);
+  free_history(h);
+  *h = n;
+  return true;
+}
+
+// Keeps what g did since the last record (or move): call it after every
+// run_grid.  Changed cells are found a word at a time and stored as the gap
+// to the previous one (7 bits a byte, high bit = more) and the old and new
+// character.  Rewound steps are dropped; so are the oldest, to make room.
+// Encoding stops once the step outgrows the ring, which drops the history.
+void
+record_step(History* h, Grid* g)
+{
+  size_t n = 0, at;
+  Step   s;
+  if (!h->prev) return;  // no history kept
+  for (int w = 0, last = 0; w < (g->length + 7) / 8 && n <= h->size; w++) {
+    Uint64 a, b;
+    memcpy(&a, g->data + w * 8, 8);
+    memcpy(&b, h->prev + w * 8, 8);
+    if (a == b) continue;
+    for (int i = w * 8; i < w * 8 + 8; i++) {
+      if (g->data[i] == h->prev[i]) continue;
+      for (Uint gap = i - last; ; gap >>= 7) {
+        h->scratch[n++] = (gap & 0x7f) | (gap > 0x7f ? 0x80 : 0);
+        if (gap <= 0x7f) break;
+      }
+      h->scratch[n++] = h->prev[i];
+      h->scratch[n++] = g->data[i];
+      h->prev[i]      = g->data[i];
+      last            = i;
+      if (n > h->size) break;  // does not fit
+    }
+  }
+  if (n > h->size) memcpy(h->prev, g->data, align(g->length));
+  s.before = h->now;
+  get_stamp(g, &h->now);
+  s.after = h->now;
+  h->n_steps -= h->undone;
+  h->undone   = 0;
+  if ((at = place_step(h, n)) == (size_t)-1) return;
+  s.at   = at;
+  s.size = n;
+  memcpy(h->ring + at, h->scratch, n);
+  h->steps[(h->first + h->n_steps++) % h->max_steps] = s;
+}
+
+// where a step of 'size' bytes goes in the ring, after dropping as many of
+// the oldest steps as it needs; -1 when it does not fit at all.  A step
+// wrapped round ends short of the oldest, so even an empty one never starts
+// where the oldest does and the ring is never taken as not wrapped.
+size_t
+place_step(History* h, size_t size)
+{
+  if (size > h->size) { h->n_steps = 0; return (size_t)-1; }
+  if (h->n_steps == h->max_steps) { h->first = (h->first + 1) % h->max_steps; h->n_steps--; }
+  while (h->n_steps) {
+    Step*  old  = &h->steps[h->first];
+    Step*  new  = &h->steps[(h->first + h->n_steps - 1) % h->max_steps];
+    size_t head = new->at + new->size, tail = old->at;
+    if (new->at >= old->at) {  // not wrapped: free at both ends
+      if (size <= h->size - head) return head;
+      if (size < tail)            return 0;
+    }
+    else if (size < tail - head) return head;
+    h->first = (h->first + 1) % h->max_steps;
+    h->n_steps--;
+  }
+  return 0;
+}
+
+// undoes up to n steps; returns how many.  Cells edited since the last
+// record stay as they are.
+int
+rewind_grid(History* h, Grid* g, int n)
+{
+  int k = 0;
+  for (; k < n && h->undone < h->n_steps; k++, h->undone++)
+    apply_step(h, g, &h->steps[(h->first + h->n_steps - h->undone - 1) % h->max_steps], false);
+  return k;
+}
+
+// redoes up to n rewound steps; returns how many
+int
+forward_grid(History* h, Grid* g, int n)
+{
+  int k = 0;
+  for (; k < n && h->undone > 0; k++, h->undone--)
+    apply_step(h, g, &h->steps[(h->first + h->n_steps - h->undone) % h->max_steps], true);
+  return k;
+}
+
+// moves g to the kept state of 'frame'; false when it is not kept
+bool
+scrub_grid(History* h, Grid* g, int frame)
+{
+  while (g->frame > frame && rewind_grid(h, g, 1)) {}
+  while (g->frame < frame && forward_grid(h, g, 1)) {}
+  return g->frame == frame;
+}
+
+// sets the cells of step s to their old values, or their new ones to redo it
+void
+apply_step(History* h, Grid* g, Step* s, bool redo)
+{
+  const Uint8* p   = h->ring + s->at;
+  const Uint8* end = p + s->size;
+  for (int i = 0; p < end; p += 2) {
+    Uint gap = 0;
+    for (int shift = 0; ; shift += 7) {
+      gap |= (Uint)(*p & 0x7f) << shift;
+      if (!(*p++ & 0x80)) break;
+    }
+    i         += gap;
+    h->prev[i] = p[redo];
+    poke_cell(g, i % g->width, i / g->width, p[redo]);
+  }
+  h->now = redo ? s->after : s->before;
+  set_stamp(g, &h->now);
+}
+
+void
+get_stamp(Grid* g, Stamp* s)
+{
+  s->frame  = g->frame;
+  s->random = g->random;
+  memcpy(s->vars, g->vars, N_VARS);
+}
+
+void
+set_stamp(Grid* g, Stamp* s)
+{
+  g->frame  = s->frame;
+  g->random = s->random;
+  memcpy(g->vars, s->vars, N_VARS);
+}
+
+void
+free_history(History* h)
+{
+  free(h->ring);
+  free(h->steps);
+  free(h->prev);
+  free(h->scratch);
+  *h = (History){ 0 };
+}
+
+// =======================================================================
+// ================================ Seek =================================
+// =======================================================================
+
+// Runs g up to 'frame', jumping over whole cycles.  Cycles are found with
+// Brent's method: the state at every power of two frames is kept, and every
+// frame after is compared with it, by hash first.  A match only counts when
+// the frames since depended on frame through a period that divides their
+// number; then every frame after runs as the ones a cycle earlier did, so
+// jumping is exact.  Notes of the frames jumped over are not played.
+bool
+seek_grid(Grid* g, int frame, Seek* s)
+{
+  struct timespec t0, t1;
+  Uint8*          data = malloc(g->length);
+  Uint8           vars[N_VARS];
+  Uint64          hash = 0;
+  int             power = 0, lam = 0, period = 1;
+  *s = (Seek){ 0 };
+  if (!data) return error("Seek", "Failed to allocate memory");
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  while (g->frame < frame) {
+    if (lam == power && !s->period) {  // move the kept state here
+      memcpy(data, g->data, g->length);
+      memcpy(vars, g->vars, N_VARS);
+      hash   = hash_grid(g);
+      power  = power ? 2 * power : 1;
+      lam    = 0;
+      period = 1;
+    }
+    run_grid(g);
+    s->frames++;
+    lam++;
+    period = lcm(period, g->period);
+    if (!s->period && period && lam % period == 0 && hash_grid(g) == hash &&
+        !memcmp(data, g->data, g->length) && !memcmp(vars, g->vars, N_VARS)) {
+      s->period   = lam;
+      s->skipped  = (frame - g->frame) / lam * lam;
+      g->frame   += s->skipped;
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  s->seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  free(data);
+  return true;
+}
+
+// =======================================================================
+// ============================== Debugging ==============================
+// =======================================================================
+
+void
+print_data_grid(Grid* g)
+{
+  for   (int y = 0; y < g->height; y++) {
+    for (int x = 0; x < g->width;  x++)
+      printf("%c", get_cell(g, x, y));
+    putchar('\n');
+  }
+  printf("========================================\n");
+}
+
+void
+print_lock_grid(Grid* g)
+{
+  for   (int y = 0; y < g->height; y++) {
+    for (int x = 0; x < g->width;  x++)
+      printf("%c", g->meta[x + y * g->width] & LOCK ? '*' : '.');
+    putchar('\n');
+  }
+  printf("========================================\n");
+}
+
+void
+print_type_grid(Grid* g)
+{
+  for   (int y = 0; y < g->height; y++) {
+    for (int x = 0; x < g->width;  x++)
+      printf("%d", g->meta[x + y * g->width] & TYPE);
+    putchar('\n');
+  }
+  printf("========================================\n");
+}
+
+// =======================================================================
+// ============================== Documents ==============================
+// =======================================================================
+
+bool
+init_grid(Grid* g, int w, int h)
+{
+  size_t n     = (size_t)w * h;
+  size_t words = WORDS(n);
+  size_t bits  = align(words * sizeof(Uint64));  // one bitmap plane
+  Uint8* block = aligned_alloc(LINE, align(n) + align(n * sizeof *g->meta) + 5 * bits);
+  if (!block) return error("Grid", "Failed to allocate memory");
+  free_grid(g);
+  g->data   = block;
+  g->meta   = block + align(n);
+  g->active = (Uint64*)(g->meta + align(n * sizeof *g->meta));
+  g->star   = (Uint64*)((Uint8*)g->active + bits);
+  g->bang   = (Uint64*)((Uint8*)g->star   + bits);
+  g->west   = (Uint64*)((Uint8*)g->bang   + bits);
+  g->east   = (Uint64*)((Uint8*)g->west   + bits);
+  g->width  = w;
+  g->height = h;
+  g->length = w * h;
+  g->frame  = 0;
+  g->random = 1;
+  memset(g->data, '.', align(n));  // padding too: the star scan reads whole cache lines
+  memset(g->active, 0, 5 * bits);
+  for (int y = 0; y < h; y++) {
+    int i = y * w, j = y * w + w - 1;
+    g->west[i / 64] |= 1ULL << (i % 64);
+    g->east[j / 64] |= 1ULL << (j % 64);
+  }
+  init_grid_frame(g);
+  return true;
+}
+
+void
+free_grid(Grid* g)
+{
+  free(g->data);
+  g->data = NULL;
+}
+
+void
+make_doc(Document* d, char* name)
+{
+  init_grid(&d->grid, HOR, VER);
+  d->unsaved = false;
+  scpy(name, d->name, FILE_NAME_SIZE);
+}
+
+// Grid is sized from the file (at least HOR x VER), then filled a row at a
+// time: the file is mapped, lines are found with memchr and copied whole,
+// characters set_cell would refuse become '.' and the active plane is built
+// once at the end.  A snapshot is recognised by SNAP_MAGIC and read as such.
+bool
+open_doc(Document* d, char* name)
+{
+  struct stat st;
+  int         w = HOR, h = VER, fd = open(name, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st)) { if (fd >= 0) close(fd); return error("Load", "Invalid input file"); }
+  size_t      size = st.st_size;
+  const char* text = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : "";
+  close(fd);
+  if (text == MAP_FAILED) return error("Load", "Invalid input file");
+  if (size >= sizeof(SnapHeader) && !memcmp(text, SNAP_MAGIC, 8)) {
+    bool ok = read_snapshot(&d->grid, (const Uint8*)text, size);
+    munmap((void*)text, size);
+    if (!ok) return error("Load", "Invalid snapshot file");
+    d->unsaved = false;
+    scpy(name, d->name, FILE_NAME_SIZE);
+    return true;
+  }
+  const char* end = text + size;
+  int         y   = 0;
+  for (const char *p = text, *nl; p < end; p = nl ? nl + 1 : end, y++) {
+    nl    = memchr(p, '\n', end - p);
+    int n = (nl ? nl : end) - p;
+    w     = n > w ? n : w;
+    if (n && y + 1 > h) h = y + 1;  // trailing empty lines add no rows
+  }
+  if (!init_grid(&d->grid, w, h)) { if (size) munmap((void*)text, size); return false; }
+  Grid* g = &d->grid;
+  y       = 0;
+  for (const char *p = text, *nl; p < end && y < h; p = nl ? nl + 1 : end, y++) {
+    nl         = memchr(p, '\n', end - p);
+    int    n   = (nl ? nl : end) - p;
+    Uint8* row = g->data + y * w;
+    memcpy(row, p, n);
+    for (int x = 0; x < n; x += 8) {
+      Uint64 v = DOTS;
+      memcpy(&v, row + x, n - x < 8 ? n - x : 8);
+      if (v == DOTS) continue;
+      for (int i = x; i < x + 8 && i < n; i++)
+        row[i] = valid_character(row[i]) ? row[i] : '.';
+    }
+  }
+  find_active(g);
+  if (size) munmap((void*)text, size);
+  d->unsaved = false;
+  scpy(name, d->name, FILE_NAME_SIZE);
+  return true;
+}
+
+bool
+save_doc(Document* d, char* name)
+{
+  if (!write_grid(&d->grid, name)) return false;
+  d->unsaved = false;
+  scpy(name, d->name, FILE_NAME_SIZE);
+  return true;
+}
+
+// The whole grid is built in one buffer and written by write_file; a name
+// ending in SNAP_SUFFIX gets a snapshot instead.
+bool
+write_grid(Grid* g, char* name)
+{
+  if (snapshot_name(name)) return write_snapshot(g, name);
+  size_t size = (size_t)g->height * (g->width + 1);
+  char*  text = malloc(size);
+  if (!text) return error("Save", "Failed to allocate memory");
+  for (int y = 0; y < g->height; y++) {
+    memcpy(text + (size_t)y * (g->width + 1), g->data + y * g->width, g->width);
+    text[(size_t)y * (g->width + 1) + g->width] = '\n';
+  }
+  bool ok = write_file(name, text, size);
+  free(text);
+  return ok;
+}
+
+// One journal record: the cells of the rectangle (x, y, w, h) as they are
+// now, as a line "x y w h" and then h lines of w cells.  'out' holds
+// JOURNAL_HEAD + h * (w + 1) bytes; returns the bytes used.
+size_t
+journal_record(Grid* g, int x, int y, int w, int h, char* out)
+{
+  size_t n = snprintf(out, JOURNAL_HEAD, "%d %d %d %d\n", x, y, w, h);
+  for (int j = 0; j < h; j++) {
+    for (int i = 0; i < w; i++)
+      out[n++] = get_cell(g, x + i, y + j);
+    out[n++] = '\n';
+  }
+  return n;
+}
+
+// Sets the cells of every whole record in journal 'name'; one cut short by
+// a crash is left out.  Returns the records applied.
+int
+replay_journal(Grid* g, char* name)
+{
+  int   x, y, w, h, n = 0;
+  char* cells;
+  FILE* f = fopen(name, "r");
+  if (!f) return 0;
+  while (fscanf(f, "%d %d %d %d", &x, &y, &w, &h) == 4 && fgetc(f) == '\n') {
+    if (w < 1 || h < 1 || (size_t)w * h > (size_t)g->length) break;  // not one of ours
+    if (!(cells = malloc((size_t)h * (w + 1)))) break;
+    bool whole = fread(cells, w + 1, h, f) == (size_t)h;
+    for (int j = 0; j < h && whole; j++)
+      for (int i = 0; i < w; i++)
+        set_cell(g, x + i, y + j, cells[j * (w + 1) + i]);
+    free(cells);
+    if (!whole) break;
+    n++;
+  }
+  fclose(f);
+  return n;
+}
+
+// Opens 'name' as a crash left it: its autosave (or the file itself) with
+// the journal of edits since replayed over it.  False when neither of the
+// two is there.
+bool
+recover_doc(Document* d, char* name)
+{
+  char save[FILE_NAME_SIZE + 16], log[FILE_NAME_SIZE + 16];
+  snprintf(save, sizeof save, "%s" AUTOSAVE_SUFFIX, name);
+  snprintf(log,  sizeof log,  "%s" JOURNAL_SUFFIX,  name);
+  bool saved = !access(save, F_OK), logged = !access(log, F_OK);
+  if (!saved && !logged) return false;
+  if (!open_doc(d, saved ? save : name)) make_doc(d, name);
+  replay_journal(&d->grid, log);
+  d->unsaved = true;
+  scpy(name, d->name, FILE_NAME_SIZE);
+  return true;
+}
+
+// 'size' bytes to a temporary file next to 'name', with one write(), which
+// then replaces it: a crash leaves either the old file or the new one.
+bool
+write_file(char* name, const void* bytes, size_t size)
+{
+  char        tmp[FILE_NAME_SIZE + 16];
+  struct stat st;
+  size_t      done = 0;
+  int         fd;
+  snprintf(tmp, sizeof tmp, "%s.XXXXXX", name);
+  if ((fd = mkstemp(tmp)) < 0) return error("Save", "Cannot create file");
+  while (done < size) {
+    ssize_t n = write(fd, (const char*)bytes + done, size - done);
+    if (n < 0) break;
+    done += n;
+  }
+  fchmod(fd, stat(name, &st) ? 0644 : st.st_mode & 0777);  // mkstemp makes it private
+  bool ok = done == size && !fsync(fd);
+  ok      = !close(fd) && ok;
+  if (!ok || rename(tmp, name)) { unlink(tmp); return error("Save", "Cannot write file"); }
+  return true;
+}
+
+// true when 'name' ends in SNAP_SUFFIX
+bool
+snapshot_name(char* name)
+{
+  size_t n = strlen(name), k = strlen(SNAP_SUFFIX);
+  return n > k && !strcmp(name + n - k, SNAP_SUFFIX);
+}
+
+// The grid with its frame, seed and variables: run_grid goes on from a
+// loaded snapshot as it would have from 'g'.
+bool
+write_snapshot(Grid* g, char* name)
+{
+  SnapHeader s = { .width = g->width, .height = g->height, .frame = g->frame, .random = g->random };
+  memcpy(s.magic, SNAP_MAGIC, 8);
+  memcpy(s.vars, g->vars, N_VARS);
+  s.hash      = hash_grid(g);
+  Uint8* file = malloc(sizeof s + g->length + g->length / 64 + 16);  // worst case of pack_cells
+  if (!file) return error("Save", "Failed to allocate memory");
+  s.size = pack_cells(g->data, g->length, file + sizeof s);
+  memcpy(file, &s, sizeof s);
+  bool ok = write_file(name, file, sizeof s + s.size);
+  free(file);
+  return ok;
+}
+
+// The header is taken as it is and the cells are unpacked straight into the
+// new grid; nothing is parsed.  False, leaving 'g' alone, when the file is
+// cut short, does not unpack to exactly the grid or fails the hash.  The
+// runs are checked against the header's size before the grid is allocated,
+// so a bad header cannot make it allocate what the file does not hold.
+bool
+read_snapshot(Grid* g, const Uint8* bytes, size_t size)
+{
+  SnapHeader s;
+  Grid       n = *g;  // keeps where its notes go
+  n.data       = NULL;
+  memcpy(&s, bytes, sizeof s);
+  if (s.width < 1 || s.height < 1 || s.width > (1 << 15) || s.height > (1 << 15)) return false;
+  if (s.size > size - sizeof s)                                                     return false;
+  if (!unpack_cells(bytes + sizeof s, s.size, NULL, (size_t)s.width * s.height))   return false;
+  if (!init_grid(&n, s.width, s.height))                                            return false;
+  n.frame  = s.frame;
+  n.random = s.random;
+  memcpy(n.vars, s.vars, N_VARS);
+  if (!unpack_cells(bytes + sizeof s, s.size, n.data, n.length) || hash_grid(&n) != s.hash) {
+    free_grid(&n);
+    return false;
+  }
+  find_active(&n);
+  free_grid(g);
+  *g = n;
+  return true;
+}
+
+// Runs of cells, each a varint (7 bits a byte, low first) n and then: when
+// n is odd, one byte standing for n >> 1 copies of it; when even, n >> 1
+// bytes as they are.  Empty patches are mostly long runs of '.'.  'out'
+// holds n + n / 64 + 16 bytes; returns the bytes used.
+size_t
+pack_cells(const Uint8* data, size_t n, Uint8* out)
+{
+  size_t used = 0, lit = 0;  // data[lit, i) is waiting to be written as it is
+  for (size_t i = 0; i <= n;) {
+    size_t run = 1;
+    if (i < n) while (i + run < n && data[i + run] == data[i]) run++;
+    if (i < n && run < 8) { i += run; continue; }  // too short to pay for itself
+    for (int odd = 0; odd < 2; odd++) {
+      size_t k = odd ? run : i - lit;
+      if (!k || (odd && i == n)) continue;
+      for (Uint64 v = (Uint64)k << 1 | odd; ; v >>= 7) {
+        out[used++] = (v & 0x7f) | (v > 0x7f ? 0x80 : 0);
+        if (v <= 0x7f) break;
+      }
+      if (odd) out[used++] = data[i];
+      else     memcpy(out + used, data + lit, k), used += k;
+    }
+    i  += run;
+    lit = i;
+  }
+  return used;
+}
+
+// the reverse of pack_cells; false unless 'in' fills 'data' exactly.  With
+// 'data' NULL the runs are only walked, to check they come to 'n' cells
+bool
+unpack_cells(const Uint8* in, size_t size, Uint8* data, size_t n)
+{
+  const Uint8* end = in + size;
+  size_t       at  = 0;
+  while (in < end) {
+    Uint64 v = 0;
+    for (int shift = 0; ; shift += 7) {
+      if (in == end || shift > 56) return false;
+      v |= (Uint64)(*in & 0x7f) << shift;
+      if (!(*in++ & 0x80)) break;
+    }
+    size_t k = v >> 1;
+    if (k > n - at || (v & 1 ? in == end : k > (size_t)(end - in))) return false;
+    if      (!data) in += v & 1 ? 1 : k;
+    else if (v & 1) memset(data + at, *in++, k);
+    else            memcpy(data + at, in, k), in += k;
+    at += k;
+  }
+  return at == n;
+}
+
+// Makes the cells of 'g' those of 'from' and leaves its frame, seed and
+// variables alone: only cells that differ are set, found eight at a time
+// (both data planes are padded with '.' to whole words).  When the sizes
+// differ 'g' takes over the planes of 'from', which is left with the old
+// ones for the caller to free.
+void
+merge_grid(Grid* g, Grid* from, Merge* m)
+{
+  if (g->width != from->width || g->height != from->height) {
+    Grid old    = *g;
+    *g          = *from;
+    g->frame    = old.frame;
+    g->random   = old.random;
+    g->midi     = old.midi;
+    g->midi_arg = old.midi_arg;
+    g->band     = old.band;
+    memcpy(g->vars, old.vars, N_VARS);
+    *from = old;
+    *m    = (Merge){ g->length, 0, 0, g->width - 1, g->height - 1, true };
+    return;
+  }
+  *m = (Merge){ 0, g->width, g->height, -1, -1, false };
+  for (int i = 0; i < g->length; i += 8) {
+    Uint64 a, b;
+    memcpy(&a, g->data + i, 8);
+    memcpy(&b, from->data + i, 8);
+    if (a == b) continue;
+    for (int k = i; k < i + 8 && k < g->length; k++) {
+      if (g->data[k] == from->data[k]) continue;
+      int x = k % g->width, y = k / g->width;
+      poke_cell(g, x, y, from->data[k]);
+      m->cells++;
+      m->x0 = x < m->x0 ? x : m->x0;
+      m->x1 = x > m->x1 ? x : m->x1;
+      m->y0 = y < m->y0 ? y : m->y0;
+      m->y1 = y;
+    }
+  }
+}
@@ -0,0 +1,458 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// ==============================================================================
+// ============================== Data Definitions ==============================
+// ==============================================================================
+
+#define HOR     35
+#define VER     25
+#define VOICES  16
+
+#define LINE   64  // cache line; every grid plane starts on one
+
+#define WORDS(n) (((n) + 63) / 64)  // 64-bit words in a bitmap of n cells
+
+typedef unsigned char Uint8;
+typedef unsigned int  Uint;
+typedef uint64_t      Uint64;
+
+typedef enum cell_type { NoOp, Comment, LeftInput, Operator, RightInput, Output, Selected, } Type;
+
+#define TYPE  0x7f  // meta bits holding the cell's Type
+#define LOCK  0x80  // meta bit set = deactivate cell = cell does not contain an operator; clear = cell contains a value
+
+#define N_VARS  36
+
+// receives the notes op_midi plays; 'arg' is the grid's midi_arg.  Under
+// run_grids it is called from pool threads, so grids sharing one must lock;
+// keiko's send_midi instead gives every grid a ring of its own.
+typedef void (*MidiFn)(void* arg, int channel, int value, int velocity, int length);
+
+typedef struct band Band;
+
+typedef struct
+{
+  int     width;
+  int     height;
+  int     length;
+  int     frame;
+  int     random;  // seed value for random number generator; default = 1
+  int     period;  // this frame depended on frame only through frame % period (LCM of C, D, U, R); 0 = untracked
+  Uint8   vars[N_VARS];
+  Uint8*  data;    // planes below share one aligned heap block, owned by data
+  Uint8*  meta;    // LOCK bit | Type (color representation); cleared every frame
+  Uint64* active;  // bit i set = data[i] is an operator character; kept by set_cell
+  Uint64* star;    // bit i set = data[i] was '*' when find_bangs last ran (frame start)
+  Uint64* bang;    // bit i set = cell i may be banged this frame; clear = certainly not
+  Uint64* west;    // bit i set = cell i is in the first column
+  Uint64* east;    // bit i set = cell i is in the last column
+  MidiFn  midi;    // where this grid's notes go; NULL = nowhere. Kept by init_grid
+  void*   midi_arg;
+  Band*   band;    // set on a band's private copy while run_bands speculates; NULL otherwise
+} Grid;
+
+#define OP_BANG  0x1  // lowercase operator; only runs when bangged
+#define OP_MOVE  0x2  // moves itself (E, N, S, W)
+
+typedef struct
+{
+  void (*fn)(Grid* g, int x, int y, char c);
+  Uint8 flags;
+} Op;
+
+extern const Op ops[256];
+
+#define FILE_NAME_SIZE    256
+#define FILE_NAME_DEFAULT "untitled.orca"
+
+#define AUTOSAVE_SUFFIX  ".autosave"  // next to a document: its last autosave
+#define JOURNAL_SUFFIX   ".journal"   // and the edits made since, see journal_record
+#define JOURNAL_HEAD     48           // bytes of a journal record's first line, at most
+
+#define SNAP_MAGIC   "KEIKOSN1"  // first bytes of a snapshot file
+#define SNAP_SUFFIX  ".snap"     // documents saved under such a name are snapshots
+
+// A snapshot file: this header, in host byte order, then 'size' bytes of
+// cells packed by pack_cells.  It keeps what run_grid needs to go on where
+// it stopped.
+typedef struct
+{
+  char   magic[8];  // SNAP_MAGIC, unterminated
+  int    width;
+  int    height;
+  int    frame;
+  int    random;
+  Uint8  vars[N_VARS];
+  Uint   size;
+  Uint64 hash;      // hash_grid of the grid it holds
+} SnapHeader;
+
+// what merge_grid changed
+typedef struct
+{
+  int  cells;           // cells set
+  int  x0, y0, x1, y1;  // the box they lie in, corners included
+  bool resized;         // the grid took the other's size: every cell changed
+} Merge;
+
+// one note op_midi played; a band holds its notes until it is committed
+typedef struct
+{
+  int channel, value, velocity, length;
+} Note;
+
+// A row band of a grid, run speculatively on a private copy.  The cells it
+// reads or writes are collected so run_bands can tell whether an earlier
+// band changed anything it saw.
+struct band
+{
+  Grid    grid;       // private copy; its window starts each frame as the grid does
+  int     from, to;   // cells [from, to): whole rows
+  int     lo, hi;     // window: cells [lo, hi), the rows an operator in the band can reach
+  bool    stale;      // the copy is out of date outside its window
+  Uint64* seen;       // bit i set = the band read or wrote cell i (or may have)
+  Uint64  read_vars;  // bit k set = vars[k] read
+  Uint64  put_vars;   // bit k set = vars[k] written
+  Uint8   vars0[N_VARS];  // vars the copy starts with: as the band found them last frame
+  Note*   notes;      // played this frame, in order
+  int     n_notes;
+  int     max_notes;
+  bool    lost;       // a note could not be kept; the band has to be re-run
+};
+
+#define REACH  36  // rows below its own an operator's ports can be (X, G: 1 + 35); J scans further
+
+// a grid split into row bands for run_bands; sized and placed for that grid
+// as it was, so init again after the grid is resized
+typedef struct
+{
+  int     n_bands;
+  Band*   bands;
+  Grid*   grid;
+  Uint8*  data0;    // the grid's data and active plane at frame start
+  Uint64* active0;
+  int     reruns;   // bands re-run serially in the last frame
+} Bands;
+
+// a pool job: called once for every i < n_jobs, on any thread
+typedef void (*JobFn)(void* arg, int i);
+
+// fixed set of threads that run_job() spreads work over; the calling
+// thread works too
+typedef struct
+{
+  int             n_threads;
+  pthread_t*      threads;
+  pthread_mutex_t lock;
+  pthread_cond_t  start;       // a new job was posted, or quit
+  pthread_cond_t  done;        // the last busy thread finished
+  Uint            generation;  // bumped for every job
+  int             busy;        // pool threads still inside the current job
+  bool            quit;
+  JobFn           job;         // the job: job(arg, i) for each i < n_jobs
+  void*           arg;
+  int             n_jobs;
+  atomic_int      next;        // next i to claim
+} Pool;
+
+// the grid's state besides its cells
+typedef struct
+{
+  int   frame;
+  int   random;
+  Uint8 vars[N_VARS];
+} Stamp;
+
+// one step of a grid as a History keeps it: the cells it changed, in the
+// History's ring at [at, at + size), and the state before and after
+typedef struct
+{
+  size_t at, size;
+  Stamp  before, after;
+} Step;
+
+#define HISTORY_BYTES  (16 << 20)  // cell changes kept by keiko; the grid as last recorded costs a byte a cell more
+#define HISTORY_STEPS  8192        // steps kept by keiko; minutes at any BPM
+
+// The last steps of a grid, for rewinding and scrubbing.  Each step is
+// stored as the cells it changed, so moving over it costs O(changed cells);
+// the oldest steps make room for new ones, so the memory used is fixed.
+// Meta is not kept: it is rebuilt by the next frame.
+typedef struct
+{
+  Uint8*  ring;       // encoded cell changes of the kept steps
+  size_t  size;
+  Step*   steps;      // kept steps, oldest at first; a ring of max_steps
+  int     max_steps;
+  int     first;
+  int     n_steps;
+  int     undone;     // steps rewound; they are redone by forward_grid
+  Uint8*  prev;       // grid data as last recorded or moved to
+  Stamp   now;        // and the rest of the grid's state then
+  Uint8*  scratch;    // one step being encoded: 'size' bytes and one change over
+} History;
+
+#define SMF_DIVISION  96   // ticks per frame: a frame is a quarter note at the render's BPM
+#define SMF_POLY      256  // notes sounding at once in a render; the one ending first makes room
+
+// a note sounding in a render, until tick 'off'
+typedef struct
+{
+  int  channel, value;
+  Uint off;
+} Voice;
+
+// A Standard MIDI File (format 0) being written; a MidiFn target.  Events
+// are written as they happen, so only the notes still sounding are kept.
+typedef struct
+{
+  FILE* file;
+  Grid* grid;       // notes are timed by its frame
+  int   bpm;
+  Uint  tick;       // time of the last event written
+  Uint  size;       // track bytes written
+  Uint  notes;      // notes written
+  Voice voices[SMF_POLY];
+  int   n_voices;
+} Smf;
+
+// a note on its way to a MIDI port, timed in frames of the port's clock
+typedef struct
+{
+  int  channel;
+  int  value;
+  int  velocity;
+  int  length;   // in frames
+  bool trigger;  // note-on not sent yet
+  Uint time;     // frame the note-on is due at
+} MidiNote;
+
+typedef struct
+{
+  Uint  offset;  // frame within the current period
+  Uint8 data[3];
+} MidiEvent;
+
+// The notes a realtime player is sounding: a table of 'size' voices (below
+// 32768), a free-list through 'next', and the voice of every channel and
+// note for retriggers.  Voices sounding are linked oldest first, which is
+// whom stealing takes.
+typedef struct
+{
+  MidiNote* note;
+  int*      prev;
+  int*      next;
+  int       size;
+  int       first, last;        // oldest and newest voice sounding; -1 = none
+  int       free;               // first free voice; -1 = none
+  int       count;              // voices sounding
+  short     held[VOICES][128];  // voice of each channel and note; -1 = none
+} Voices;
+
+#define SEEK_PERIOD  (1 << 30)  // longest frame period seek_grid tracks
+
+// what seek_grid did
+typedef struct
+{
+  int    frames;   // frames run
+  int    skipped;  // frames jumped over: whole cycles
+  int    period;   // the cycle; 0 = none found
+  double seconds;
+} Seek;
+
+typedef struct
+{
+  bool  unsaved;
+  char  name[FILE_NAME_SIZE];
+  Grid  grid;
+} Document;
+
+// ==============================================================================
+// ============================== Helper Functions ==============================
+// ==============================================================================
+
+int    clamp(int val, int min, int max);
+bool   cisp(char c);
+char   cchr(int v, char c);
+int    cb36(char c);
+char   cuca(char c);
+char   clca(char c);
+char   cinc(char c);
+char   cdec(char c);
+bool   valid_position(Grid* g, int x, int y);
+bool   valid_character(char c);
+int    ctbl(char c);
+char*  scpy(char* src, char* dst, int len);
+char   get_cell(Grid* g, int x, int y);
+void   set_cell(Grid* g, int x, int y, char c);
+Type   get_type(Grid* g, int x, int y);
+void   set_type(Grid* g, int x, int y, Type type);
+void   set_lock(Grid* g, int x, int y);
+void   set_port(Grid* g, int x, int y, char c);
+int    get_port(Grid* g, int x, int y, bool lock);
+bool   inside(Grid* g, int x0, int y0, int x1, int y1);
+char   peek_cell(Grid* g, int x, int y);
+void   poke_cell(Grid* g, int x, int y, char c);
+void   poke_lock(Grid* g, int x, int y);
+void   poke_port(Grid* g, int x, int y, char c);
+int    peek_port(Grid* g, int x, int y, bool lock);
+int    read_port(Grid* g, int x, int y, bool lock, bool fast);
+void   write_port(Grid* g, int x, int y, char c, bool fast);
+Uint8  get_var(Grid* g, int k);
+void   set_var(Grid* g, int k, Uint8 v);
+bool   bangged(Grid* g, int x, int y);
+void   mark_bang(Grid* g, int x, int y);
+Uint64 span(int w, int from, int to);
+int    lcm(int a, int b);
+void   clocked(Grid* g, int period);
+Uint64 hash_grid(Grid* g);
+size_t align(size_t size);
+bool   error(char* msg, const char* err);
+
+// ==================================================================
+// ============================== MIDI ==============================
+// ==================================================================
+
+// op_midi hands notes to Grid.midi; Smf renders them to a file and Voices
+// plays them to a port, a period at a time
+
+bool   open_smf(Smf* s, char* name, Grid* g, int bpm);
+void   smf_note(void* arg, int channel, int value, int velocity, int length);
+void   smf_release(Smf* s, Uint tick);
+void   smf_event(Smf* s, Uint tick, int status, int a, int b);
+void   smf_write(Smf* s, const Uint8* bytes, int n);
+bool   close_smf(Smf* s);
+bool   init_voices(Voices* v, int size);
+void   free_voices(Voices* v);
+int    take_voice(Voices* v);
+void   drop_voice(Voices* v, int i);
+void   start_note(Voices* v, MidiNote* n, int limit, MidiEvent* ev, int* n_events);
+void   play_voices(Voices* v, Uint start, Uint n_frames, MidiEvent* ev, int* n_events);
+void   add_event(MidiEvent* ev, int* n, Uint offset, int status, int value, int velocity);
+
+// =======================================================================
+// ============================== Operators ==============================
+// =======================================================================
+
+void operate(Grid* g, int x, int y, char c);
+void run_grid(Grid* g);
+void run_cells(Grid* g, int from, int to);
+void run_cell(Grid* g, int i);
+void init_grid_frame(Grid* g);
+void find_bangs(Grid* g);
+void find_active(Grid* g);
+void find_stars_scalar(const Uint8* data, Uint64* star, int words);
+void find_stars_sse2(const Uint8* data, Uint64* star, int words);
+void find_stars_avx2(const Uint8* data, Uint64* star, int words);
+bool init_grid(Grid* g, int w, int h);
+void free_grid(Grid* g);
+void op_a(Grid* g, int x, int y, char c);
+void op_b(Grid* g, int x, int y, char c);
+void op_c(Grid* g, int x, int y, char c);
+void op_d(Grid* g, int x, int y, char c);
+void op_e(Grid* g, int x, int y, char c);
+void op_f(Grid* g, int x, int y, char c);
+void op_g(Grid* g, int x, int y, char c);
+void op_h(Grid* g, int x, int y, char c);
+void op_i(Grid* g, int x, int y, char c);
+void op_j(Grid* g, int x, int y, char c);
+void op_k(Grid* g, int x, int y, char c);
+void op_l(Grid* g, int x, int y, char c);
+void op_m(Grid* g, int x, int y, char c);
+void op_n(Grid* g, int x, int y, char c);
+void op_o(Grid* g, int x, int y, char c);
+void op_p(Grid* g, int x, int y, char c);
+void op_q(Grid* g, int x, int y, char c);
+void op_r(Grid* g, int x, int y, char c);
+void op_s(Grid* g, int x, int y, char c);
+void op_t(Grid* g, int x, int y, char c);
+void op_u(Grid* g, int x, int y, char c);
+void op_v(Grid* g, int x, int y, char c);
+void op_w(Grid* g, int x, int y, char c);
+void op_x(Grid* g, int x, int y, char c);
+void op_y(Grid* g, int x, int y, char c);
+void op_z(Grid* g, int x, int y, char c);
+void op_bang(Grid* g, int x, int y, char c);
+void op_comment(Grid* g, int x, int y, char c);
+void op_midi(Grid* g, int x, int y, char c);
+
+// =======================================================================
+// ============================== Scheduler ==============================
+// =======================================================================
+
+bool  init_pool(Pool* p, int threads);
+void* pool_thread(void* arg);
+void  pool_work(Pool* p);
+void  run_job(Pool* p, JobFn job, void* arg, int n);
+void  run_grids(Pool* p, Grid** grids, int n);
+void  run_grid_job(void* arg, int i);
+void  free_pool(Pool* p);
+
+// =======================================================================
+// ================================ Bands ================================
+// =======================================================================
+
+int   row_ops(Grid* g, int y);
+int   band_start(Grid* g, int y, int min, int max);
+bool  init_bands(Bands* t, Grid* g, int n);
+void  run_bands(Pool* p, Bands* t);
+void  run_band(void* arg, int i);
+void  band_midi(void* arg, int channel, int value, int velocity, int length);
+bool  band_valid(Bands* t, Band* b);
+void  commit_band(Bands* t, Band* b);
+void  free_bands(Bands* t);
+
+// =======================================================================
+// =============================== History ===============================
+// =======================================================================
+
+bool   init_history(History* h, Grid* g, size_t bytes, int steps);
+void   record_step(History* h, Grid* g);
+size_t place_step(History* h, size_t size);
+int    rewind_grid(History* h, Grid* g, int n);
+int    forward_grid(History* h, Grid* g, int n);
+bool   scrub_grid(History* h, Grid* g, int frame);
+void   apply_step(History* h, Grid* g, Step* s, bool redo);
+void   get_stamp(Grid* g, Stamp* s);
+void   set_stamp(Grid* g, Stamp* s);
+void   free_history(History* h);
+
+// =======================================================================
+// ================================ Seek =================================
+// =======================================================================
+
+bool   seek_grid(Grid* g, int frame, Seek* s);
+
+// =======================================================================
+// ============================== Debugging ==============================
+// =======================================================================
+
+void print_data_grid(Grid* g);
+void print_lock_grid(Grid* g);
+void print_type_grid(Grid* g);
+
+// =======================================================================
+// ============================== Documents ==============================
+// =======================================================================
+
+void   make_doc(Document* d, char* name);
+bool   open_doc(Document* d, char* name);
+bool   save_doc(Document* d, char* name);
+bool   write_grid(Grid* g, char* name);
+size_t journal_record(Grid* g, int x, int y, int w, int h, char* out);
+int    replay_journal(Grid* g, char* name);
+bool   recover_doc(Document* d, char* name);
+bool   write_file(char* name, const void* bytes, size_t size);
+bool   snapshot_name(char* name);
+bool   write_snapshot(Grid* g, char* name);
+bool   read_snapshot(Grid* g, const Uint8* bytes, size_t size);
+size_t pack_cells(const Uint8* data, size_t n, Uint8* out);
+bool   unpack_cells(const Uint8* in, size_t size, Uint8* data, size_t n);
+void   merge_grid(Grid* g, Grid* from, Merge* m);
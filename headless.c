@@ -0,0 +1,106 @@
+#include <time.h>
+#include <unistd.h>
+#include "engine.h"
+
+// keiko-headless: runs an .orca patch through the engine without SDL or JACK.
+//
+//   keiko-headless [-n frames] [-m] [-j threads] [-b frames] [-s] [-o file.mid [-t bpm]] [-w file] file.orca
+//
+// Prints the final grid (or, with -m, every MIDI note sent) to stdout and the
+// achieved frame rate to stderr.  With -j every frame is split into row bands
+// run on that many extra threads (see run_bands); the output is the same.
+// With -b every frame is recorded and the grid is rewound that many frames
+// before it is printed; it is then the grid of a run that many frames shorter.
+// With -s the frames are run by seek_grid, which jumps over whole cycles once
+// it finds one; the grid is the same, but notes of skipped frames are not sent.
+// With -o the notes are rendered to a Standard MIDI File instead, a frame to
+// a quarter note at -t BPM (120), as keiko would play them.  With -w the
+// final grid is also saved to that file; a name ending in .snap gets a
+// snapshot, which a later run (given it instead of the .orca) goes on from.
+
+Document doc;
+bool     MIDI = false;  // true = dump MIDI events instead of the final grid
+
+void
+print_midi(void* arg, int channel, int value, int velocity, int length)
+{
+  Grid* g = arg;
+  printf("%d %d %d %d %d\n", g->frame, channel, value, velocity, length);
+}
+
+double
+now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int
+usage(char* name)
+{
+  fprintf(stderr, "usage: %s [-n frames] [-m] [-j threads] [-b frames] [-s] [-o file.mid [-t bpm]] [-w file] file.orca\n", name);
+  return 1;
+}
+
+int
+main(int argc, char* argv[])
+{
+  int     opt, frames = 1000, threads = -1, back = 0, bpm = 120;
+  char*   render = NULL, *out = NULL;
+  Smf     smf;
+  bool    seek = false;
+  Seek    s;
+  Pool    pool;
+  Bands   bands;
+  History history = { 0 };
+  while ((opt = getopt(argc, argv, "n:mj:b:so:t:w:")) != -1) {
+    if      (opt == 'n') frames  = atoi(optarg);
+    else if (opt == 'm') MIDI    = true;
+    else if (opt == 'j') threads = atoi(optarg);
+    else if (opt == 'b') back    = atoi(optarg);
+    else if (opt == 's') seek    = true;
+    else if (opt == 'o') render  = optarg;
+    else if (opt == 't') bpm     = clamp(atoi(optarg), 1, 999);
+    else if (opt == 'w') out     = optarg;
+    else                 return usage(argv[0]);
+  }
+  if (optind != argc - 1)            return usage(argv[0]);
+  if (!open_doc(&doc, argv[optind])) return 1;
+  if (MIDI) { doc.grid.midi = print_midi; doc.grid.midi_arg = &doc.grid; }
+  if (render) {
+    if (!open_smf(&smf, render, &doc.grid, bpm)) return 1;
+    doc.grid.midi     = smf_note;
+    doc.grid.midi_arg = &smf;
+  }
+
+  if (threads >= 0 && (!init_pool(&pool, threads) || !init_bands(&bands, &doc.grid, threads + 1))) return 1;
+  if (back > 0 && !init_history(&history, &doc.grid, HISTORY_BYTES, HISTORY_STEPS)) return 1;
+
+  double start = now();
+  if (seek && !seek_grid(&doc.grid, frames, &s)) return 1;
+  for (int i = 0; i < frames && !seek; i++) {
+    threads < 0 ? run_grid(&doc.grid) : run_bands(&pool, &bands);
+    if (back > 0) record_step(&history, &doc.grid);
+  }
+  if (render && !close_smf(&smf)) return 1;
+  double elapsed = now() - start;
+
+  if (back > 0) {
+    double t = now();
+    int    n = rewind_grid(&history, &doc.grid, back);
+    fprintf(stderr, "rewound %d frames in %.6f s\n", n, now() - t);
+  }
+
+  if (out && !write_grid(&doc.grid, out)) return 1;
+  if (!MIDI)
+    for   (int y = 0; y < doc.grid.height; y++) {
+      for (int x = 0; x < doc.grid.width;  x++)
+        putchar(get_cell(&doc.grid, x, y));
+      putchar('\n');
+    }
+  if (seek)   fprintf(stderr, "seek: %d frames run, %d skipped (period %d)\n", s.frames, s.skipped, s.period);
+  if (render) fprintf(stderr, "%s: %u notes, %.1f s at %d BPM\n", render, smf.notes, frames * 60.0 / bpm, bpm);
+  fprintf(stderr, "%d frames in %.3f s: %.0f fps\n", frames, elapsed, elapsed > 0 ? frames / elapsed : 0);
+  return 0;
+}
@@ -3,26 +3,45 @@
 int
 main(int argc, char* argv[])
 {
+  int opt;
+  while ((opt = getopt(argc, argv, "p:")) != -1)
+    if (opt == 'p') set_shared(&POLYPHONY, clamp(atoi(optarg), 1, POLY));
+    else            return usage(argv[0]);
   if (!init()) return error("Init", "Failure");
 
-  if      (argc == 1)                 make_doc(&doc, FILE_NAME_DEFAULT);
-  else if (!open_doc(&doc, argv[1]))  make_doc(&doc, argv[1]);
+  if      (optind == argc)           make_file(FILE_NAME_DEFAULT);
+  else if (!open_file(argv[optind])) make_file(argv[optind]);
+  for (int i = optind + 1; i < argc; i++) add_part(argv[i]);
+  publish(&doc);
+  redraw();
+  if (!init_sequencer()) return error("Init", "Sequencer");
 
+  // the sequencer thread steps the grid; this thread edits it and draws the
+  // latest snapshot.  Everything queued is handled before the next redraw,
+  // which waits for vsync, so there is at most one redraw per refresh.
   while (true) {
-    double start, elapsed;
     SDL_Event event;
-    elapsed = (SDL_GetPerformanceCounter() - start) / (double)SDL_GetPerformanceFrequency() * 1000.0f;
-    if (!PAUSE && elapsed > 60000.0 / BPM) { frame(); start = SDL_GetPerformanceCounter(); }
-    SDL_Delay(clamp(16.666f - elapsed, 0, 1000));  // can reduce CPU load
-    while (SDL_PollEvent(&event)) {
+    bool      draw = false;
+    if (!SDL_WaitEvent(&event)) continue;
+    do {
+      if (event.type == TICK) { atomic_store(&ticked, false); draw = true; continue; }
+      pthread_mutex_lock(&grid_lock);
       if      (event.type == SDL_QUIT)            quit();
       else if (event.type == SDL_MOUSEBUTTONUP)   do_mouse(&event);
       else if (event.type == SDL_MOUSEBUTTONDOWN) do_mouse(&event);
       else if (event.type == SDL_MOUSEMOTION)     do_mouse(&event);
       else if (event.type == SDL_KEYDOWN)         do_key(&event);
       else if (event.type == SDL_TEXTINPUT)       do_text(&event);
-      else if (event.type == SDL_WINDOWEVENT)     { if (event.window.event == SDL_WINDOWEVENT_EXPOSED) redraw(pixels); }
+      else if (event.type == RELOAD)              { reload(); DIRTY = 1; }  // in case nothing plays
+      else if (event.type == SDL_WINDOWEVENT)     { if (event.window.event == SDL_WINDOWEVENT_EXPOSED) draw = true; }
+      pthread_mutex_unlock(&grid_lock);
+    } while (SDL_PollEvent(&event));
+    if (DIRTY) {
+      pthread_mutex_lock(&grid_lock);
+      publish(&doc);
+      pthread_mutex_unlock(&grid_lock);
     }
+    if (draw || DIRTY) { DIRTY = 0; redraw(); }
   }
 }
 
@@ -30,641 +49,215 @@ main(int argc, char* argv[])
 // ============================== Operators ==============================  
 // =======================================================================  
 
+// single step from the UI thread, grid_lock held
 void
 frame()
 {
-  run_grid(&doc.grid);
-  redraw(pixels);
+  tick_time = client ? jack_frame_time(client) : 0;
+  run_grids(&pool, grids, n_grids);
+  record_step(&history, &doc.grid);
+  DIRTY = 1;
 }
 
+// from the UI thread, grid_lock held: rewinds n frames, or redoes -n
 void
-run_grid(Grid* g)
+scrub(int n)
 {
-  init_grid_frame(g);
-  for (int i = 0; i < g->length; i++) {
-    char c = g->data[i];
-    int  x = i % g->width;
-    int  y = i / g->width;
-    if      (c == '.')                                  continue;
-    else if (g->lock[i])                                continue;
-    else if (c >= '0' && c <= '9')                      continue;
-    else if (c >= 'a' && c <= 'z' && !bangged(g, x, y)) continue;
-    else                                                operate(g, x, y, c);
-  }
-  // print_lock_grid(g);
-  g->frame++;
-}
-
-void
-init_grid_frame(Grid* g)
-{
-  memset(g->lock, false, MAXSZ * sizeof *g->lock);
-  memset(g->type, NoOp,  MAXSZ * sizeof *g->type);
-  memset(g->vars, '.',  N_VARS * sizeof *g->vars);
-}
-
-void
-operate(Grid* g, int x, int y, char op)
-{
-  set_type(g, x, y, Operator);
-  if      (op == 'A') op_a(g, x, y);           // add(a b)             Outputs sum of inputs.
-  else if (op == 'B') op_b(g, x, y);           // subtract(a b)        Outputs difference of inputs.
-  else if (op == 'C') op_c(g, x, y);           // clock(rate mod)      Outputs modulo of frame.
-  else if (op == 'D') op_d(g, x, y);           // delay(rate mod)      Bangs on modulo of frame.
-  else if (op == 'E') op_e(g, x, y, op);       // east                 Moves eastward, or bangs.
-  else if (op == 'F') op_f(g, x, y);           // if(a b)              Bangs if inputs are equal.
-  else if (op == 'G') op_g(g, x, y);           // generator(x y len)   Writes operands with offset.
-  else if (op == 'H') op_h(g, x, y);           // halt                 Halts southward operand.
-  else if (op == 'I') op_i(g, x, y);           // increment(step mod)  Increments southward operand.
-  else if (op == 'J') op_j(g, x, y, op);       // jumper(val)          Outputs northward operand.
-  else if (op == 'K') op_k(g, x, y);           // konkat(len)          Reads multiple variables.
-  else if (op == 'L') op_l(g, x, y);           // less(a b)            Outputs smallest of inputs.
-  else if (op == 'M') op_m(g, x, y);           // multiply(a b)        Outputs product of inputs.
-  else if (op == 'N') op_n(g, x, y, op);       // north                Moves Northward, or bangs.
-  else if (op == 'O') op_o(g, x, y);           // read(x y read)       Reads operand with offset.
-  else if (op == 'P') op_p(g, x, y);           // push(len key val)    Writes eastward operand.
-  else if (op == 'Q') op_q(g, x, y);           // query(x y len)       Reads operands with offset.
-  else if (op == 'R') op_r(g, x, y);           // random(min max)      Outputs random value.
-  else if (op == 'S') op_s(g, x, y, op);       // south                Moves southward, or bangs.
-  else if (op == 'T') op_t(g, x, y);           // track(key len val)   Reads eastward operand.
-  else if (op == 'U') op_u(g, x, y);           // uclid(step max)      Bangs on Euclidean rhythm.
-  else if (op == 'V') op_v(g, x, y);           // variable(write read) Reads and writes variable.
-  else if (op == 'W') op_w(g, x, y, op);       // west                 Moves westward, or bangs.
-  else if (op == 'X') op_x(g, x, y);           // write(x y val)       Writes operand with offset.
-  else if (op == 'Y') op_y(g, x, y, op);       // jymper(val)          Outputs westward operand.
-  else if (op == 'Z') op_z(g, x, y);           // lerp(rate target)    Transitions operand to input.
-  else if (op == '*') set_cell(g, x, y, '.');  // bang                 Bangs neighboring operands.
-  else if (op == '#') op_comment(g, x, y);     // comment              Halts a line.
-  else if (op == ':') op_midi(g, x, y);        // midi                 Sends a MIDI note.
-  else                printf("Unknown operator[%d,%d]: %c\n", x, y, op);
-}
-
-// add(a b); Outputs sum of inputs.
-void
-op_a(Grid* g, int x, int y)
-{
-  char a = get_port(g, x - 1, y, false);
-  char b = get_port(g, x + 1, y, true);
-  set_port(g, x, y + 1, cchr(cb36(a) + cb36(b), b));
-}
-
-// subtract(a b); Outputs difference of inputs.
-void
-op_b(Grid* g, int x, int y)
-{
-  char a = get_port(g, x - 1, y, false);
-  char b = get_port(g, x + 1, y, true);
-  set_port(g, x, y + 1, cchr(cb36(a) - cb36(b), b));
-}
-
-// clock(rate mod); Outputs modulo of frame.
-void
-op_c(Grid* g, int x, int y)
-{
-  char rate  = get_port(g, x - 1, y, false);
-  char mod   = get_port(g, x + 1, y, true);
-  int  mod_  = cb36(mod);  if (!mod_)  mod_  = 8;
-  int  rate_ = cb36(rate); if (!rate_) rate_ = 1;
-  set_port(g, x, y + 1, cchr(g->frame / rate_ % mod_, mod));
-}
-
-// delay(rate mod); Bangs on modulo of frame.
-void
-op_d(Grid* g, int x, int y)
-{
-  char rate  = get_port(g, x - 1, y, false);
-  char mod   = get_port(g, x + 1, y, true);
-  int  rate_ = cb36(rate); if (!rate_) rate_ = 1;
-  int  mod_  = cb36(mod);  if (!mod_)  mod_  = 8;
-  set_port(g, x, y + 1, g->frame % (rate_ * mod_) == 0 ? '*' : '.');
-}
-
-// east; Moves eastward, or bangs.
-void
-op_e(Grid* g, int x, int y, char c)
-{
-  if (x >= g->width - 1 || get_cell(g, x + 1, y) != '.')
-    set_cell(g, x, y, '*');
-  else {
-    set_cell(g, x    , y, '.');
-    set_port(g, x + 1, y,  c);
-    set_type(g, x + 1, y,  NoOp);
-  }
-  set_type(g, x, y, NoOp);
-}
-
-// if(a b); Bangs if inputs are equal.
-void
-op_f(Grid* g, int x, int y)
-{
-  char a = get_port(g, x - 1, y, false);
-  char b = get_port(g, x + 1, y, true);
-  set_port(g, x, y + 1, a == b ? '*' : '.');
-}
-
-// generator(x y len); Writes operands with offset.
-void
-op_g(Grid* g, int x, int y)
-{
-  char px   = get_port(g, x - 3, y, false);
-  char py   = get_port(g, x - 2, y, false);
-  char len  = get_port(g, x - 1, y, false);
-  int  len_ = cb36(len); if (!len_) len_ = 1;
-  for (int i = 0; i < len_; i++)
-    set_port(g, x + i + cb36(px), y + 1 + cb36(py), get_port(g, x + 1 + i, y, true));
-}
-
-// halt; Halts southward operand.
-void
-op_h(Grid* g, int x, int y)
-{
-  get_port(g, x, y + 1, true);
-}
-
-// increment(step mod); Increments southward operand.
-void
-op_i(Grid* g, int x, int y)
-{
-  char rate  = get_port(g, x - 1, y    , false);
-  char mod   = get_port(g, x + 1, y    , true);
-  char val   = get_port(g, x    , y + 1, true);
-  int  rate_ = cb36(rate); if (!rate_) rate_ = 1;
-  int  mod_  = cb36(mod);  if (!mod_)  mod_  = N_VARS;
-  set_port(g, x, y + 1, cchr((cb36(val) + rate_) % mod_, mod));
-}
-
-// jumper(val); Outputs northward operand.
-void
-op_j(Grid* g, int x, int y, char c)
-{
-  char link = get_port(g, x, y - 1, false);
-  if (link != c) {
-    int i;
-    for (i = 1; y + i < g->height; i++)
-      if (get_cell(g, x, y + i) != c) break;
-    set_port(g, x, y + i, link);
-  }
-}
-
-// konkat(len); Reads multiple variables.
-void
-op_k(Grid* g, int x, int y)
-{
-  char len  = get_port(g, x - 1, y, false);
-  int  len_ = cb36(len); if (!len_) len_ = 1;
-  for (int i = 0; i < len_; i++) {
-    char key =      get_port(g, x + 1 + i, y    , true);
-    if (key != '.') set_port(g, x + 1 + i, y + 1, g->vars[cb36(key)]);
-  }
-}
-
-// less(a b); Outputs smallest of inputs.
-void
-op_l(Grid* g, int x, int y)
-{
-  char a = get_port(g, x - 1, y, false);
-  char b = get_port(g, x + 1, y, true);
-  set_port(g, x, y + 1, cb36(a) < cb36(b) ? a : b);
-}
-
-// multiply(a b); Outputs product of inputs.
-void
-op_m(Grid* g, int x, int y)
-{
-  char a = get_port(g, x - 1, y, false);
-  char b = get_port(g, x + 1, y, true);
-  set_port(g, x, y + 1, cchr(cb36(a) * cb36(b), b));
+  n > 0 ? rewind_grid(&history, &doc.grid, n) : forward_grid(&history, &doc.grid, -n);
+  DIRTY = 1;
 }
 
-// north; Moves Northward, or bangs.
-void
-op_n(Grid* g, int x, int y, char c)
+// sequencer thread: runs one grid frame for every step process() queues,
+// at the JACK frame it was due at.  Without JACK it keeps time itself
+// against CLOCK_MONOTONIC.
+void*
+sequence(void* arg)
 {
-  if (y <= 0 || get_cell(g, x, y - 1) != '.')
-    set_cell(g, x, y    , '*');
-  else {
-    set_cell(g, x, y    , '.');
-    set_port(g, x, y - 1,  c);
-    set_type(g, x, y - 1,  NoOp);
-  }
-  set_type(g, x, y, NoOp);
-}
-
-// read(x y read); Reads operand with offset.
-void
-op_o(Grid* g, int x, int y)
-{
-  char px = get_port(g, x - 2, y, false);
-  char py = get_port(g, x - 1, y, false);
-  set_port(g, x, y + 1, get_port(g, x + 1 + cb36(px), y + cb36(py), true));
-}
-
-// push(len key val); Writes eastward operand.
-void
-op_p(Grid* g, int x, int y)
-{
-  char key  = get_port(g, x - 2, y, false);
-  char len  = get_port(g, x - 1, y, false);
-  char val  = get_port(g, x + 1, y, true);
-  int  len_ = cb36(len); if (!len_) len_ = 1;
-  for (int i = 0; i < len_; i++)
-    set_lock(g, x + i, y + 1);                      // can only be values not operators
-  set_port(g, x + (cb36(key) % len_), y + 1, val);
-}
-
-// query(x y len); Reads operands with offset.
-void
-op_q(Grid* g, int x, int y)
-{
-  char px   = get_port(g, x - 3, y, false);
-  char py   = get_port(g, x - 2, y, false);
-  char len  = get_port(g, x - 1, y, false);
-  int  len_ = cb36(len); if (!len_) len_ = 1;
-  for (int i = 0; i < len_; i++)
-    set_port(g, x + 1 - len_ + i, y + 1, get_port(g, x + 1 + cb36(px) + i, y + cb36(py), true));
-}
-
-// random(min max); Outputs random value.
-void
-op_r(Grid* g, int x, int y)
-{
-  char min  = get_port(g, x - 1, y, false);
-  char max  = get_port(g, x + 1, y, true);
-  int  max_ = cb36(max); if (!max_)        max_ = N_VARS;
-  int  min_ = cb36(min); if (min_ == max_) min_ = max_ - 1;
-  Uint key  = (g->random + y * g->width + x) ^ (g->frame << 16);
-  key = (key ^ 61U) ^ (key >> 16);
-  key =  key + (key << 3);
-  key =  key ^ (key >> 4);
-  key =  key * 0x27d4eb2d;
-  key =  key ^ (key >> 15);
-  set_port(g, x, y + 1, cchr(key % (max_ - min_) + min_, max));
-}
-
-// south; Moves southward, or bangs.
-void
-op_s(Grid* g, int x, int y, char c)
-{
-  if (y >= g->height - 1 || get_cell(g, x, y + 1) != '.')
-    set_cell(g, x, y    , '*');
-  else {
-    set_cell(g, x, y    , '.');
-    set_port(g, x, y + 1,  c);
-    set_type(g, x, y + 1,  NoOp);
-  }
-  set_type(g, x, y, NoOp);
-}
-
-// track(key len val); Reads eastward operand.
-void
-op_t(Grid* g, int x, int y)
-{
-  char key  = get_port(g, x - 2, y, false);
-  char len  = get_port(g, x - 1, y, false);
-  int  len_ = cb36(len); if (!len_) len_ = 1;
-  for (int i = 0; i < len_; i++)
-    set_lock(g, x + 1 + i, y);  // can only be values not operators
-  set_port(g, x, y + 1, get_port(g, x + 1 + (cb36(key) % len_), y, true));
-}
-
-// uclid(step max); Bangs on Euclidean rhythm.
-void
-op_u(Grid* g, int x, int y)
-{
-  char step   = get_port(g, x - 1, y, false);
-  char max    = get_port(g, x + 1, y, true);
-  int  step_  = cb36(step); if (!step_) step_ = 1;
-  int  max_   = cb36(max);  if (!max_)  max_  = 8;
-  int  bucket = (step_ * (g->frame + max_ - 1)) % max_ + step_;
-  set_port(g, x, y + 1, bucket >= max_ ? '*' : '.');
-}
-
-// variable(write read); Reads and writes variable.
-void
-op_v(Grid* g, int x, int y)
-{
-  char w = get_port(g, x - 1, y, false);
-  char r = get_port(g, x + 1, y, true);
-  if      (w != '.')             g->vars[cb36(w)] = r;
-  else if (w == '.' && r != '.') set_port(g, x, y + 1, g->vars[cb36(r)]);
-}
-
-// west; Moves westward, or bangs.
-void
-op_w(Grid* g, int x, int y, char c)
-{
-  if (x <= 0 || get_cell(g, x - 1, y) != '.')
-    set_cell(g, x    , y, '*');
-  else {
-    set_cell(g, x    , y, '.');
-    set_port(g, x - 1, y,  c);
-    set_type(g, x - 1, y,  NoOp);
-  }
-  set_type(g, x, y, NoOp);
-}
-
-// write(x y val); Writes operand with offset.
-void
-op_x(Grid* g, int x, int y)
-{
-  char px  = get_port(g, x - 2, y, false);
-  char py  = get_port(g, x - 1, y, false);
-  char val = get_port(g, x + 1, y, true);
-  set_port(g, x + cb36(px), y + cb36(py) + 1, val);
-}
-
-// jymper(val); Outputs westward operand.
-void
-op_y(Grid* g, int x, int y, char c)
-{
-  int i;
-  char link = get_port(g, x - 1, y, false);
-  if (link != c) {
-    for (i = 1; x + i < g->width; i++)
-      if (get_cell(g, x + i, y) != c) break;
-    set_port(g, x + i, y, link);
+  struct timespec next;
+  jack_nframes_t  t;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (true) {
+    if (client) sem_wait(&tick);
+    else {
+      int bpm = atomic_load_explicit(&BPM, memory_order_relaxed);
+      next.tv_nsec += 60000000000LL / bpm % 1000000000;
+      next.tv_sec  += 60 / bpm + next.tv_nsec / 1000000000;
+      next.tv_nsec %= 1000000000;
+      clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+      if (!atomic_load_explicit(&PAUSE, memory_order_relaxed)) push_tick(&ticks, 0);
+    }
+    bool ran = false;
+    while (pop_tick(&ticks, &t)) {
+      pthread_mutex_lock(&grid_lock);
+      tick_time = t;
+      reload();
+      run_grids(&pool, grids, n_grids);
+      record_step(&history, &doc.grid);
+      publish(&doc);
+      pthread_mutex_unlock(&grid_lock);
+      ran = true;
+    }
+    if (ran && !atomic_exchange(&ticked, true)) SDL_PushEvent(&(SDL_Event){ .type = TICK });
   }
+  return NULL;
 }
 
-// lerp(rate target); Transitions operand to input.
-void
-op_z(Grid* g, int x, int y)
-{
-  char rate    = get_port(g, x - 1, y    , false);
-  char target  = get_port(g, x + 1, y    , true);
-  char val     = get_port(g, x    , y + 1, true);
-  int  rate_   = cb36(rate); if (!rate_) rate_ = 1;
-  int  target_ = cb36(target);
-  int  val_    = cb36(val);
-  int  mod     = val_ <= target_ - rate_ ?  rate_ : 
-                 val_ >= target_ + rate_ ? -rate_ : target_ - val_;
-  set_port(g, x, y + 1, cchr(val_ + mod, target));
-}
-
-// comment; Halts a line.
+// copy the visible part of the grid into the back snapshot and swap it into
+// the middle slot for the renderer; grid_lock held
 void
-op_comment(Grid* g, int x, int y)
+publish(Document* d)
 {
-  for (int i = 1; x + i < g->width; i++) {
-    set_lock(g, x + i, y);  // deactivate cells
-    if (get_cell(g, x + i, y) == '#') break;
-  }
-  set_type(g, x, y, Comment);
+  Grid*     g = &d->grid;
+  Snapshot* s = &snaps[back];
+  s->frame   = g->frame;
+  s->unsaved = d->unsaved;
+  for   (int y = 0; y < VER; y++)
+    for (int x = 0; x < HOR; x++) {
+      s->data[y][x] = get_cell(g, x, y);
+      s->type[y][x] = get_type(g, x, y);
+    }
+  back = atomic_exchange(&middle, back | FRESH) & ~FRESH;
 }
 
-// midi; Sends a MIDI note.
-void
-op_midi(Grid* g, int x, int y)
+// newest published snapshot; UI thread only
+Snapshot*
+take_snapshot()
 {
-  int channel  = cb36(get_port(g, x + 1, y, true)); if (channel     == '.') return;
-  int octave   = cb36(get_port(g, x + 2, y, true)); if (octave      == '.') return;
-  int note     =      get_port(g, x + 3, y, true);  if (cisp(note))         return;
-  int velocity =      get_port(g, x + 4, y, true);  if (velocity    == '.') velocity = 'z';
-  int length   =      get_port(g, x + 5, y, true);
-  if (bangged(g, x, y)) {
-    send_midi(clamp(channel, 0, VOICES - 1),
-              12 * octave + ctbl(note),
-              clamp(cb36(velocity), 0, N_VARS),
-              clamp(cb36(length),   1, N_VARS));
-    set_type(g, x, y, Operator);
-  } else
-    set_type(g, x, y, LeftInput);
+  if (atomic_load(&middle) & FRESH)
+    front = atomic_exchange(&middle, front) & ~FRESH;
+  return &snaps[front];
 }
 
-// ==============================================================================  
-// ============================== Helper Functions ==============================  
-// ==============================================================================  
-
-int
-clamp(int val, int min, int max)
-{
-  return (val >= min) ? ((val <= max) ? val : max) : min;
-}
-
-// is c special character?
+// the pool gets a thread for each part, as far as the cores go; the
+// sequencer thread runs a grid too
 bool
-cisp(char c)
-{
-  return c == '.' || c == ':' || c == '#' || c == '*';
-}
-
-// int 'v' to char
-// result has same case as 'c'
-char
-cchr(int v, char c)
-{
-  v = abs(v % N_VARS);
-  if (v >= 0 && v <= 9) return '0' + v;
-  return (c >= 'A' && c <= 'Z' ? 'A' : 'a') + v - 10;
-}
-
-// char to 0 <= int <= 35
-int
-cb36(char c)
+init_sequencer()
 {
-  if (c >= '0' && c <= '9') return c - '0';
-  if (c >= 'A' && c <= 'Z') return c - 'A' + 10;
-  if (c >= 'a' && c <= 'z') return c - 'a' + 10;
-  return 0;
-}
-
-// to upper-case
-char
-cuca(char c)
-{
-  return c >= 'a' && c <= 'z' ? 'A' + c - 'a' : c;
-}
-
-// to lower-case
-char
-clca(char c)
-{
-  return c >= 'A' && c <= 'Z' ? 'a' + c - 'A' : c;
-}
-
-char
-cinc(char c)
-{
-  return cisp(c) ? c : cchr(cb36(c) + 1, c);
+  int cores = sysconf(_SC_NPROCESSORS_ONLN);
+  if (!init_pool(&pool, clamp(n_grids - 1, 0, cores - 1))) return false;
+  if (pthread_create(&sequencer, NULL, sequence, NULL)) return false;
+  atomic_store(&sequencing, true);
+  return true;
 }
 
-char
-cdec(char c)
-{
-  return cisp(c) ? c : cchr(cb36(c) - 1, c);
-}
+// ==================================================================  
+// ============================== MIDI ==============================  
+// ==================================================================  
 
+// called from the thread running the ring's grid only, which run_grids may
+// change from frame to frame but never within one; false = ring full, note
+// dropped
 bool
-valid_position(Grid* g, int x, int y)
+push_note(MidiRing* r, MidiNote* n)
 {
-  return x >= 0 && x <= g->width - 1 && y >= 0 && y <= g->height - 1;
+  Uint head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  Uint tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+  if (head - tail == RING) return false;
+  r->notes[head & (RING - 1)] = *n;
+  atomic_store_explicit(&r->head, head + 1, memory_order_release);
+  return true;
 }
 
+// called from process() only; false = ring empty
 bool
-valid_character(char c)
-{
-  return cb36(c) || c == '0' || cisp(c);
-}
-
-// char to note (used in send_midi)
-int
-ctbl(char c)
-{
-  int notes[7] = { 0, 2, 4, 5, 7, 9, 11 };
-  if (c >= '0' && c <= '9') return c - '0';
-  bool sharp = c >= 'a' && c <= 'z';
-  int  uc    = sharp ? c - 'a' + 'A' : c;
-  int  deg   = uc <= 'B' ? 'G' - 'B' + uc - 'A' : uc - 'C';
-  return deg / 7 * 12 + notes[deg % 7] + sharp;
-}
-
-// string copy; len includes zero-terminal
-char*
-scpy(char* src, char* dst, int len)
-{
-  int i = 0;
-  while ((dst[i] = src[i]) && i < len - 2) i++;
-  dst[i + 1] = '\0';
-  return dst;
-}
-
-char
-get_cell(Grid* g, int x, int y)
+pop_note(MidiRing* r, MidiNote* n)
 {
-  if (valid_position(g, x, y)) return g->data[x + (y * g->width)];
-  return '.';
-}
-
-void
-set_cell(Grid* g, int x, int y, char c)
-{
-  if (valid_position(g, x, y) && valid_character(c))
-    g->data[x + (y * g->width)] = c;
+  Uint tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  Uint head = atomic_load_explicit(&r->head, memory_order_acquire);
+  if (head == tail) return false;
+  *n = r->notes[tail & (RING - 1)];
+  atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+  return true;
 }
 
-Type
-get_type(Grid* g, int x, int y)
+// tick ring: process() produces, the sequencer thread consumes
+bool
+push_tick(TickRing* r, jack_nframes_t t)
 {
-  if (valid_position(g, x, y))
-    return g->type[x + (y * g->width)];
-  return NoOp;
+  Uint head = atomic_load_explicit(&r->head, memory_order_relaxed);
+  Uint tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+  if (head - tail == TICKS) return false;
+  r->times[head & (TICKS - 1)] = t;
+  atomic_store_explicit(&r->head, head + 1, memory_order_release);
+  return true;
 }
 
-// set cell's coloring
-void
-set_type(Grid* g, int x, int y, Type type)
+bool
+pop_tick(TickRing* r, jack_nframes_t* t)
 {
-  if (valid_position(g, x, y))
-    g->type[x + (y * g->width)] = type;
+  Uint tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+  Uint head = atomic_load_explicit(&r->head, memory_order_acquire);
+  if (head == tail) return false;
+  *t = r->times[tail & (TICKS - 1)];
+  atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+  return true;
 }
 
-// deactivate cell (cell contains number/value but not operator)
+// queue every step due inside this period.  A step is 60 / BPM seconds; the
+// division remainder is carried in tick_rest, so steps never drift from the
+// sample clock however long it runs.  Paused, the next step is held at the
+// start of the coming period, as it is until the sequencer thread runs.
 void
-set_lock(Grid* g, int x, int y)
+queue_ticks(jack_nframes_t start, jack_nframes_t n_frames)
 {
-  if (valid_position(g, x, y)) {
-    g->lock[x + (y * g->width)] = true;
-    if (get_type(g, x, y) != NoOp)
-        set_type(g, x, y, Comment);
+  Uint64 end  = clock_frames + n_frames;
+  int    bpm  = atomic_load_explicit(&BPM, memory_order_relaxed);
+  bool   hold = atomic_load_explicit(&PAUSE, memory_order_relaxed) || !atomic_load(&sequencing);
+  if (hold && next_tick < end) next_tick = end;
+  while (next_tick < end) {
+    Uint64 step = (Uint64)jack_get_sample_rate(client) * 60 + tick_rest;
+    if (push_tick(&ticks, start + (jack_nframes_t)(next_tick - clock_frames)))
+      sem_post(&tick);
+    next_tick += step / bpm;
+    tick_rest  = step % bpm;
   }
+  clock_frames = end;
 }
 
-// set operator's output
-void
-set_port(Grid* g, int x, int y, char c)
-{
-  set_lock(g, x, y);          // output is a value; will not turn into an operator
-  set_type(g, x, y, Output);
-  set_cell(g, x, y, c);
-}
-
-// get operator's input
-int
-get_port(Grid* g, int x, int y, bool lock)
-{
-  if (lock) {
-    set_lock(g, x, y);              // right-hand side of operator cannot be an operator
-    set_type(g, x, y, RightInput);
-  } else
-    set_type(g, x, y, LeftInput);
-  return get_cell(g, x, y);
-}
-
-bool
-bangged(Grid* g, int x, int y)
-{
-  return get_cell(g, x - 1, y    ) == '*' ||
-         get_cell(g, x + 1, y    ) == '*' ||
-         get_cell(g, x    , y - 1) == '*' ||
-         get_cell(g, x    , y + 1) == '*';
-}
-
-size_t
-get_list_length()
-{
-  size_t    n    = 0;
-  MidiList* list = voices;
-  while (list) { n++; list = list->next; }
-  return n;
-}
-
-bool
-error(char* msg, const char* err)
-{
-  printf("Error %s: %s\n", msg, err);
-  return false;
-}
-
-// ==================================================================  
-// ============================== MIDI ==============================  
-// ==================================================================  
-
+// JACK realtime thread: no allocation, no locks; voices is ours alone.
+// Every note-on and note-off lands on the exact frame it is due at, or on
+// the first frame of this period if it is already late.
 int
 process(jack_nframes_t n_frames, void* arg)
 {
-  MidiList*         note_to_delete;
+  MidiNote          note;
+  MidiEvent         events[POLY * 3];  // on and off of every voice, and an off for each stolen
+  int               n_events = 0;
+  int               limit    = atomic_load_explicit(&POLYPHONY, memory_order_relaxed);
   jack_midi_data_t* buffer;
-  void*             port_buf = jack_port_get_buffer(output_port, 1);
+  jack_nframes_t    start    = jack_last_frame_time(client);
+  void*             port_buf = jack_port_get_buffer(output_port, n_frames);
   jack_midi_clear_buffer(port_buf);
+  queue_ticks(start, n_frames);
 
-  MidiList* iter = voices;
-  while (iter->next) {
-    MidiNote* n = &iter->next->note;
-    if (n->trigger) {
-      n->trigger = false;
-      buffer     = jack_midi_event_reserve(port_buf, 0, 3);
-      buffer[0]  = 0x90 + n->channel;
-      buffer[1]  = n->value;
-      buffer[2]  = n->velocity;
-    } else {
-      n->length -= n_frames;
-      if (n->length < 0) {
-        buffer         = jack_midi_event_reserve(port_buf, 0, 3);
-        buffer[0]      = 0x80 + n->channel;
-        buffer[1]      = n->value;
-        buffer[2]      = 0;
-        note_to_delete = iter->next;
-        iter->next     = iter->next->next;
-        free(note_to_delete);
-        continue;
-      }
-    }
-    iter = iter->next;
-  }
+  for (int d = 0; d < DOCS; d++)  // the grids' notes merge here, into one port
+    while (pop_note(&rings[d], &note))
+      start_note(&voices, &note, limit, events, &n_events);
+  play_voices(&voices, start, n_frames, events, &n_events);
+
+  for (int i = 0; i < n_events; i++)
+    if ((buffer = jack_midi_event_reserve(port_buf, events[i].offset, 3)))
+      memcpy(buffer, events[i].data, 3);
+  atomic_store_explicit(&active, voices.count, memory_order_relaxed);
   return 0;
 }
 
+// every grid's MidiFn; 'arg' is the grid's own ring, so grids run together
+// on the pool never share one
 void
-send_midi(int channel, int value, int velocity, int length)
+send_midi(void* arg, int channel, int value, int velocity, int length)
 {
-  MidiList* ml      = malloc(sizeof *ml);
-  ml->next          = voices->next;
-  voices->next      = ml;
-  ml->note.channel  = channel;
-  ml->note.value    = value;
-  ml->note.velocity = velocity * 3;
-  ml->note.length   = length * ( 60 / (float)BPM ) * jack_get_sample_rate(client);
-  ml->note.trigger  = true;
+  if (!client) return;
+  float    beat = 60 / (float)atomic_load_explicit(&BPM, memory_order_relaxed);  // seconds
+  MidiNote note = {
+    .channel  = channel,
+    .value    = clamp(value, 0, 127),  // as smf_note
+    .velocity = velocity * 3,
+    .length   = length * beat * jack_get_sample_rate(client),
+    .trigger  = true,
+    .time     = tick_time + jack_get_buffer_size(client),  // a constant period behind its step, which is already being rendered
+  };
+  push_note(arg, &note);
 }
 
 bool
@@ -673,51 +266,15 @@ init_midi()
   if (!(client = jack_client_open("Keiko", JackNullOption, NULL)))
     return error("Jack", "JACK server not running?\n");
   printf("Jack client: %p\n", client);
+  if (!init_voices(&voices, POLY)) return false;
   jack_set_process_callback(client, process, 0);
   output_port = jack_port_register(client, "midi-out", JACK_DEFAULT_MIDI_TYPE, JackPortIsOutput, 0);
-  if (jack_activate(client))
+  if (jack_activate(client)) {
+    jack_client_close(client);
+    client = NULL;  // the sequencer falls back to its own clock
     return error("Jack", "cannot activate client");
-  voices       = malloc(sizeof *voices);
-  voices->next = NULL;
-  voices->note = (MidiNote){};
-  return true;
-}
-
-// =======================================================================
-// ============================== Debugging ==============================
-// =======================================================================
-
-void
-print_data_grid(Grid* g)
-{
-  for   (int y = 0; y < g->height; y++) {
-    for (int x = 0; x < g->width;  x++)
-      printf("%c", get_cell(g, x, y));
-    putchar('\n');
-  }
-  printf("========================================\n");
-}
-
-void
-print_lock_grid(Grid* g)
-{
-  for   (int y = 0; y < g->height; y++) {
-    for (int x = 0; x < g->width;  x++)
-      printf("%c", g->lock[x + y * g->width] ? '*' : '.');
-    putchar('\n');
-  }
-  printf("========================================\n");
-}
-
-void
-print_type_grid(Grid* g)
-{
-  for   (int y = 0; y < g->height; y++) {
-    for (int x = 0; x < g->width;  x++)
-      printf("%d", g->type[x + y * g->width]);
-    putchar('\n');
   }
-  printf("========================================\n");
+  return true;
 }
 
 // =====================================================================
@@ -741,77 +298,110 @@ get_font(int x, int y, char c, int type, int sel)
   return 70;
 }
 
+// upload font[] and icons[] once as white-on-clear tiles, plus one solid tile
+// for backgrounds; cells are drawn from it as colour-modulated quads
+bool
+init_atlas()
+{
+  static Uint32 atlas[ATLAS_H * 8][ATLAS_W * 8];
+  for   (int g = 0; g <= GLYPHS; g++)
+    for (int i = 0; i < 64; i++) {
+      Uint8 bits = g == SOLID ? 0xff : g < FONTS ? font[g][i / 8] : icons[g - FONTS][i / 8];
+      atlas[g / ATLAS_W * 8 + i / 8][g % ATLAS_W * 8 + i % 8] = (bits >> (7 - i % 8)) & 0x1 ? 0xffffffff : 0;
+    }
+  for (int q = 0; q < CELLS * 2; q++)
+    for (int i = 0; i < 6; i++)
+      quads[q * 6 + i] = q * 4 + (int[]){ 0, 1, 2, 1, 3, 2 }[i];
+  memset(drawn, 0xff, sizeof drawn);
+  if (SDL_SetTextureBlendMode(gTexture, SDL_BLENDMODE_BLEND)) return false;
+  return !SDL_UpdateTexture(gTexture, NULL, atlas, sizeof *atlas);
+}
+
+// four corners of the 8x8 quad at x, y showing atlas tile 'tile' in theme colour 'color'
 void
-set_pixel(Uint32* dst, int x, int y, int color)
+set_quad(SDL_Vertex* v, int x, int y, int tile, int color)
 {
-  if (x >= 0 && x < WIDTH - 8 && y >= 0 && y < HEIGHT - 8)
-    dst[(y + PAD * 8) * WIDTH + (x + PAD * 8)] = theme[color];
+  SDL_Color c  = { theme[color] >> 16, theme[color] >> 8, theme[color], 0xff };
+  float     u  = (float)(tile % ATLAS_W) / ATLAS_W, w = 1.0f / ATLAS_W;
+  float     t  = (float)(tile / ATLAS_W) / ATLAS_H, h = 1.0f / ATLAS_H;
+  x += PAD * 8;
+  y += PAD * 8;
+  v[0] = (SDL_Vertex){ { x    , y     }, c, { u    , t     } };
+  v[1] = (SDL_Vertex){ { x + 8, y     }, c, { u + w, t     } };
+  v[2] = (SDL_Vertex){ { x    , y + 8 }, c, { u    , t + h } };
+  v[3] = (SDL_Vertex){ { x + 8, y + 8 }, c, { u + w, t + h } };
 }
 
+// x, y in pixels, multiples of 8; the cell's vertices are only rewritten
+// when its glyph or colours change
 void
-draw_icon(Uint32* dst, int x, int y, Uint8* icon, int fg, int bg)
+draw_icon(int x, int y, int glyph, int fg, int bg)
 {
-  for   (int v = 0; v < 8; v++)
-    for (int h = 0; h < 8; h++) {
-      int clr = (icon[v] >> (7 - h)) & 0x1;
-      set_pixel(dst, x + h, y + v, clr == 1 ? fg : bg);
-    }
+  int    cx  = x / 8, cy = y / 8;
+  Uint32 key = glyph << 8 | fg << 4 | bg;
+  if (drawn[cy][cx] == key) return;
+  drawn[cy][cx] = key;
+  SDL_Vertex* v = &verts[(cy * HOR + cx) * 8];
+  set_quad(v,     x, y, SOLID, bg);
+  set_quad(v + 4, x, y, glyph, fg);
 }
 
 void
-draw_ui(Uint32* dst)
+draw_ui(Snapshot* s)
 {
-  int n = get_list_length(), bottom = VER * 8 + 8;
+  int n     = atomic_load_explicit(&active, memory_order_relaxed), bottom = VER * 8 + 8;
+  int bpm   = atomic_load_explicit(&BPM,    memory_order_relaxed);
+  int pause = atomic_load_explicit(&PAUSE,  memory_order_relaxed);
   // ---------- cursor -------------------
-  draw_icon(dst,  0 * 8, bottom, font[cursor.x % N_VARS], 1                                   , 0);
-  draw_icon(dst,  1 * 8, bottom, font[68]               , 1                                   , 0);
-  draw_icon(dst,  2 * 8, bottom, font[cursor.y % N_VARS], 1                                   , 0);
-  draw_icon(dst,  3 * 8, bottom, icons[2]               , cursor.w > 1 || cursor.h > 1 ? 4 : 3, 0);
+  draw_icon( 0 * 8, bottom, cursor.x % N_VARS, 1                                   , 0);
+  draw_icon( 1 * 8, bottom, 68               , 1                                   , 0);
+  draw_icon( 2 * 8, bottom, cursor.y % N_VARS, 1                                   , 0);
+  draw_icon( 3 * 8, bottom, ICON(2)          , cursor.w > 1 || cursor.h > 1 ? 4 : 3, 0);
   // ---------- frame --------------------
-  draw_icon(dst,  5 * 8, bottom, font[(doc.grid.frame / 1296)   % N_VARS] , 1                                    , 0);
-  draw_icon(dst,  6 * 8, bottom, font[(doc.grid.frame / N_VARS) % N_VARS] , 1                                    , 0);
-  draw_icon(dst,  7 * 8, bottom, font[ doc.grid.frame % N_VARS]           , 1                                    , 0);
-  draw_icon(dst,  8 * 8, bottom, icons[PAUSE ? 1 : 0]                     , (doc.grid.frame - 1) % 8 == 0 ? 2 : 3, 0);
+  draw_icon( 5 * 8, bottom, (s->frame / 1296)   % N_VARS, 1                                , 0);
+  draw_icon( 6 * 8, bottom, (s->frame / N_VARS) % N_VARS, 1                                , 0);
+  draw_icon( 7 * 8, bottom,  s->frame % N_VARS          , 1                                , 0);
+  draw_icon( 8 * 8, bottom, ICON(pause ? 1 : 0)         , (s->frame - 1) % 8 == 0 ? 2 : 3, 0);
   // ---------- speed --------------------
-  draw_icon(dst, 10 * 8, bottom, font[(BPM / 100) % 10], 1, 0);
-  draw_icon(dst, 11 * 8, bottom, font[(BPM /  10) % 10], 1, 0);
-  draw_icon(dst, 12 * 8, bottom, font[ BPM %  10]      , 1, 0);
+  draw_icon(10 * 8, bottom, (bpm / 100) % 10, 1, 0);
+  draw_icon(11 * 8, bottom, (bpm /  10) % 10, 1, 0);
+  draw_icon(12 * 8, bottom,  bpm %  10      , 1, 0);
   // ---------- io -----------------------
-  draw_icon(dst, 13 * 8, bottom, n > 0 ? icons[2 + clamp(n, 0, 6)] : font[70], 2, 0);
+  draw_icon(13 * 8, bottom, n > 0 ? ICON(2 + clamp(n, 0, 6)) : 70, 2, 0);
   // ---------- generics -----------------
-  draw_icon(dst, 15 * 8       , bottom, icons[GUIDES ? 10 : 9], GUIDES      ? 1 : 2, 0);
-  draw_icon(dst, (HOR - 1) * 8, bottom, icons[11]             , doc.unsaved ? 2 : 3, 0);
+  draw_icon(15 * 8       , bottom, ICON(GUIDES ? 10 : 9), GUIDES      ? 1 : 2, 0);
+  draw_icon((HOR - 1) * 8, bottom, ICON(11)             , s->unsaved  ? 2 : 3, 0);
 }
 
 void
-redraw(Uint32* dst)
+redraw()
 {
-  Rect* r = &cursor;
+  Rect*     r = &cursor;
+  Snapshot* s = take_snapshot();
   for   (int y = 0; y < VER; y++) {
     for (int x = 0; x < HOR; x++) {
       bool   sel    = x <  r->x + r->w && 
                       x >= r->x        && 
                       y <  r->y + r->h && 
                       y >= r->y;
-      Type   type   = get_type(&doc.grid, x, y);
-      Uint8* letter = font[get_font(x, y, get_cell(&doc.grid, x, y), type, sel)];
+      Type   type   = s->type[y][x];
+      int    glyph  = get_font(x, y, s->data[y][x], type, sel);
       int    fg     = 0;
       int    bg     = 0;
-      if ((sel && !MODE) || (sel && MODE && doc.grid.frame % 2)) { fg = 0; bg = 4; }
+      if ((sel && !MODE) || (sel && MODE && s->frame % 2)) { fg = 0; bg = 4; }
       else if (type == Comment)    fg = 3;
       else if (type == LeftInput)  fg = 1;
       else if (type == Operator)   bg = 1;
       else if (type == RightInput) fg = 2;
       else if (type == Output)     bg = 2;
       else                         fg = 3;
-      draw_icon(dst, x * 8, y * 8, letter, fg, bg);
+      draw_icon(x * 8, y * 8, glyph, fg, bg);
     }
   }
-  draw_ui(dst);
-  SDL_UpdateTexture (gTexture, NULL, dst, WIDTH * sizeof(Uint32));
-  SDL_RenderClear   (gRenderer);
-  SDL_RenderCopy    (gRenderer, gTexture, NULL, NULL);
-  SDL_RenderPresent (gRenderer);
+  draw_ui(s);
+  SDL_RenderClear    (gRenderer);
+  SDL_RenderGeometry (gRenderer, gTexture, verts, CELLS * 8, quads, CELLS * 12);
+  SDL_RenderPresent  (gRenderer);
 }
 
 // =======================================================================
@@ -819,60 +409,52 @@ redraw(Uint32* dst)
 // =======================================================================
 
 void
-init_grid(Grid* g, int w, int h)
+make_file(char* name)
 {
-  g->width  = w;
-  g->height = h;
-  g->length = w * h;
-  g->frame  = 0;
-  g->random = 1;
-  memset(g->data, '.', MAXSZ * sizeof *g->data);
-  init_grid_frame(g);
+  make_doc(&doc, name);
+  if (!init_history(&history, &doc.grid, HISTORY_BYTES, HISTORY_STEPS)) free_history(&history);
+  follow(name, false);
+  watch(name);
+  DIRTY = 1;
+  printf("Made: %s\n", name);
 }
 
-void
-make_doc(Document* d, char* name)
-{
-  init_grid(&d->grid, HOR, VER);
-  d->unsaved = false;
-  scpy(name, d->name, FILE_NAME_SIZE);
-  redraw(pixels);
-  printf("Made: %s\n", name);
+// a crashed session's work is recovered from its autosave and journal
+bool
+open_file(char* name)
+{
+  bool recovered = recover_doc(&doc, name);
+  if (!recovered && !open_doc(&doc, name)) return false;
+  if (!init_history(&history, &doc.grid, HISTORY_BYTES, HISTORY_STEPS)) free_history(&history);
+  follow(name, recovered);
+  watch(name);
+  DIRTY = 1;
+  printf(recovered ? "Recovered: %s\n" : "Opened: %s\n", name);
+  return true;
 }
 
+// from main, before the sequencer starts: 'name' plays along with the
+// document, its notes merged with the others into the one port
 bool
-open_doc(Document* d, char* name)
+add_part(char* name)
 {
-  char c;
-  int x = 0, y = 0;
-  FILE* f = fopen(name, "r");
-  if (!f) return error("Load", "Invalid input file");
-  init_grid(&d->grid, HOR, VER);
-  while ((c = fgetc(f)) != EOF && d->grid.length <= MAXSZ) {
-    if   (c == '\n') { x = 0; y++; }
-    else             { set_cell(&d->grid, x, y, c); x++; }
-  }
-  d->unsaved = false;
-  scpy(name, d->name, FILE_NAME_SIZE);
-  redraw(pixels);
-  printf("Opened: %s\n", name);
+  if (n_grids == DOCS)                      return error("Part", "Too many documents");
+  if (!open_doc(&parts[n_grids - 1], name)) return false;
+  grids[n_grids] = &parts[n_grids - 1].grid;
+  n_grids++;
+  printf("Playing: %s\n", name);
   return true;
 }
 
+// handed to the writer thread, which reports it when done
 void
-save_doc(Document* d, char* name)
+save_file(char* name)
 {
-  FILE* f = fopen(name, "w");
-  for   (int y = 0; y < d->grid.height; y++) {
-    for (int x = 0; x < d->grid.width;  x++)
-      fputc(get_cell(&d->grid, x, y), f);
-    fputc('\n', f);
-  }
-  fclose(f);
-  d->unsaved = false;
-  scpy(name, d->name, FILE_NAME_SIZE);
-  redraw(pixels);
-  printf("Saved: %s\n", name);
+  pthread_mutex_lock(&writer.lock);
+  writer.save = true;
+  scpy(name, writer.save_name, FILE_NAME_SIZE);
+  pthread_cond_signal(&writer.wake);
+  pthread_mutex_unlock(&writer.lock);
 }
 
 void
@@ -884,14 +466,23 @@ transform(Rect* r, char (*fn)(char))
       int y_ = r->y + y;
       set_cell(&doc.grid, x_, y_, fn(get_cell(&doc.grid, x_, y_)));
     }
-  redraw(pixels);
+  journal(r->x, r->y, r->w, r->h);
+  doc.unsaved = true;
+  DIRTY = 1;
 }
 
 void
 set_option(int* i, int v)
 {
   *i = v;
-  redraw(pixels);
+  DIRTY = 1;
+}
+
+void
+set_shared(atomic_int* i, int v)
+{
+  atomic_store_explicit(i, v, memory_order_relaxed);
+  DIRTY = 1;
 }
 
 void
@@ -907,7 +498,7 @@ select1(int x, int y, int w, int h)
       r.w != cursor.w ||
       r.h != cursor.h) {
     cursor = r;
-    redraw(pixels);
+    DIRTY = 1;
   }
 }
 
@@ -945,8 +536,9 @@ comment(Rect* r)
     set_cell(&doc.grid, r->x           , r->y + y, c);
     set_cell(&doc.grid, r->x + r->w - 1, r->y + y, c);
   }
+  journal(r->x, r->y, r->w, r->h);
   doc.unsaved = true;
-  redraw(pixels);
+  DIRTY = 1;
 }
 
 void
@@ -955,18 +547,19 @@ insert(char c)
   for   (int x = 0; x < cursor.w; x++)
     for (int y = 0; y < cursor.h; y++)
       set_cell(&doc.grid, cursor.x + x, cursor.y + y, c);
+  journal(cursor.x, cursor.y, cursor.w, cursor.h);
   if (MODE) move(1, 0, 0);
   doc.unsaved = true;
-  redraw(pixels);
+  DIRTY = 1;
 }
 
 void
 select_option(int option)
 {
   if      (option == 3)       select1(cursor.x, cursor.y, 1, 1);
-  else if (option == 8)       { PAUSE = 1; frame(); }
+  else if (option == 8)       { set_shared(&PAUSE, 1); frame(); }
   else if (option == 15)      set_option(&GUIDES, !GUIDES);
-  else if (option == HOR - 1) save_doc(&doc, doc.name);
+  else if (option == HOR - 1) save_file(doc.name);
 }
 
 void
@@ -979,7 +572,7 @@ copy_clip(Rect* r, char* c)
     c[i++] = '\n';
   }
   c[i] = '\0';
-  redraw(pixels);
+  DIRTY = 1;
 }
 
 void
@@ -996,12 +589,15 @@ paste_clip(Rect* r, char* c, bool insert)
   int i = 0;
   int x = r->x;
   int y = r->y;
+  int w = 0;
   while ((ch = c[i++])) {
     if   (ch == '\n') { x = r->x; y++; }
     else              { set_cell(&doc.grid, x, y, insert && ch == '.' ? get_cell(&doc.grid, x, y) : ch); x++; }
+    w = x - r->x > w ? x - r->x : w;
   }
+  if (w) journal(r->x, r->y, w, y - r->y + (x > r->x));
   doc.unsaved = true;
-  redraw(pixels);
+  DIRTY = 1;
 }
 
 void
@@ -1013,6 +609,250 @@ move_clip(Rect* r, char* c, int x, int y, bool skip)
   paste_clip(r, c, 0);
 }
 
+// ====================================================================
+// ============================== Writer ==============================
+// ====================================================================
+
+bool
+init_writer()
+{
+  return !pthread_create(&writer.thread, NULL, write_files, NULL);
+}
+
+// The writer thread.  Journal records are appended as soon as they are
+// queued, so a crash loses at most the edit being made.  Saves, and at most
+// every AUTOSAVE seconds an autosave, write a copy of the grid taken under
+// grid_lock; the journal then starts again from that copy.
+void*
+write_files(void* arg)
+{
+  Writer*         w    = &writer;
+  Grid            copy = { 0 };
+  char*           out  = NULL;  // records being written, swapped with the queue
+  size_t          size = 0, n;
+  int             fd   = -1;    // the journal, once opened
+  bool            fresh = false;  // the journal and autosave there are stale: replace them
+  char            name[FILE_NAME_SIZE] = "", log[FILE_NAME_SIZE + 16], save[FILE_NAME_SIZE + 16];
+  struct timespec due  = { 0 }, t;
+  pthread_mutex_lock(&w->lock);
+  while (true) {
+    clock_gettime(CLOCK_REALTIME, &t);
+    if (w->moved) {  // the next records go to the new document's journal
+      if (fd >= 0) close(fd);
+      fd       = -1;
+      w->moved = false;
+      scpy(w->name, name, FILE_NAME_SIZE);
+      snprintf(log,  sizeof log,  "%s" JOURNAL_SUFFIX,  name);
+      snprintf(save, sizeof save, "%s" AUTOSAVE_SUFFIX, name);
+      fresh = !w->resume;  // kept until the first edit, in case it is never made
+    }
+    else if (w->used) {
+      char* q = w->queue; w->queue = out; out = q;
+      n = w->used; w->used = 0;
+      size_t s = w->size; w->size = size; size = s;
+      pthread_mutex_unlock(&w->lock);
+      if (fd < 0 && fresh) unlink(save);
+      if (fd < 0) fd = open(log, O_WRONLY | O_CREAT | O_APPEND | (fresh ? O_TRUNC : 0), 0644);
+      fresh = fresh && fd < 0;
+      if (fd < 0 || !append_file(fd, out, n)) error("Journal", "Cannot write file");
+      pthread_mutex_lock(&w->lock);
+    }
+    else if (w->save || (w->edits && t.tv_sec >= due.tv_sec)) {
+      bool saving = w->save;
+      char target[FILE_NAME_SIZE];
+      scpy(saving ? w->save_name : save, target, FILE_NAME_SIZE);
+      pthread_mutex_unlock(&w->lock);
+      pthread_mutex_lock(&grid_lock);  // the UI takes grid_lock before w->lock, so does this
+      pthread_mutex_lock(&w->lock);
+      if (w->used || w->moved) { pthread_mutex_unlock(&grid_lock); continue; }  // those first
+      bool copied = (copy.width == doc.grid.width && copy.height == doc.grid.height) ||
+                    init_grid(&copy, doc.grid.width, doc.grid.height);
+      if (copied) memcpy(copy.data, doc.grid.data, doc.grid.length);
+      copy.frame  = doc.grid.frame;  // a snapshot keeps these
+      copy.random = doc.grid.random;
+      memcpy(copy.vars, doc.grid.vars, N_VARS);
+      int edits = w->edits;
+      w->save   = false;
+      w->edits  = 0;
+      pthread_mutex_unlock(&w->lock);
+      pthread_mutex_unlock(&grid_lock);
+      if (saving) pthread_mutex_lock(&watcher.own_lock);  // the watcher sees it as ours
+      bool ok = copied && write_grid(&copy, target);
+      if (ok && fd >= 0 && ftruncate(fd, 0)) error("Journal", "Cannot truncate file");
+      if (ok && saving) {  // the document has it all
+        if (fd >= 0) close(fd);
+        fd = -1;
+        unlink(log);
+        unlink(save);
+        struct stat st;
+        if (!stat(target, &st)) { watcher.own = st.st_mtim; watcher.own_ino = st.st_ino; }
+        printf("Saved: %s\n", target);
+      }
+      if (saving) pthread_mutex_unlock(&watcher.own_lock);
+      pthread_mutex_lock(&grid_lock);
+      pthread_mutex_lock(&w->lock);
+      if (!ok) w->edits += edits;  // try again later; the journal still has them
+      if (ok && saving && !w->edits) { doc.unsaved = false; publish(&doc); }
+      pthread_mutex_unlock(&w->lock);
+      pthread_mutex_unlock(&grid_lock);
+      SDL_PushEvent(&(SDL_Event){ .type = TICK });  // redraw the unsaved mark
+      clock_gettime(CLOCK_REALTIME, &due);
+      due.tv_sec += AUTOSAVE;
+      pthread_mutex_lock(&w->lock);
+    }
+    else if (w->edits) pthread_cond_timedwait(&w->wake, &w->lock, &due);
+    else               pthread_cond_wait(&w->wake, &w->lock);
+  }
+  return NULL;
+}
+
+// all of 'text', then to the disk
+bool
+append_file(int fd, char* text, size_t n)
+{
+  for (ssize_t k; n; text += k, n -= k)
+    if ((k = write(fd, text, n)) < 0) return false;
+  return !fdatasync(fd);
+}
+
+// from the UI thread, grid_lock held: queue the edit of the rectangle
+// (x, y, w, h) for the journal
+void
+journal(int x, int y, int w, int h)
+{
+  x = clamp(x, 0, doc.grid.width - 1);
+  y = clamp(y, 0, doc.grid.height - 1);
+  w = clamp(w, 1, doc.grid.width - x);
+  h = clamp(h, 1, doc.grid.height - y);
+  pthread_mutex_lock(&writer.lock);
+  size_t need = writer.used + JOURNAL_HEAD + (size_t)h * (w + 1);
+  if (need > writer.size) {
+    char* q = realloc(writer.queue, 2 * need);
+    if (!q) { pthread_mutex_unlock(&writer.lock); error("Journal", "Failed to allocate memory"); return; }
+    writer.queue = q;
+    writer.size  = 2 * need;
+  }
+  writer.used += journal_record(&doc.grid, x, y, w, h, writer.queue + writer.used);
+  writer.edits++;
+  pthread_cond_signal(&writer.wake);
+  pthread_mutex_unlock(&writer.lock);
+}
+
+// from the UI thread, grid_lock held: the document is now 'name'; its
+// journal is appended to when 'resume', else replaced
+void
+follow(char* name, bool resume)
+{
+  pthread_mutex_lock(&writer.lock);
+  scpy(name, writer.name, FILE_NAME_SIZE);
+  writer.moved  = true;
+  writer.resume = resume;
+  writer.used   = 0;
+  writer.edits  = 0;
+  pthread_cond_signal(&writer.wake);
+  pthread_mutex_unlock(&writer.lock);
+}
+
+// =====================================================================
+// ============================== Watcher ==============================
+// =====================================================================
+
+bool
+init_watcher()
+{
+  if ((watcher.fd = inotify_init1(IN_CLOEXEC)) < 0) return false;
+  return !pthread_create(&watcher.thread, NULL, watch_files, NULL);
+}
+
+// The watcher thread: the document's directory is watched, not the file,
+// so that editors replacing it by a rename are seen too.
+void*
+watch_files(void* arg)
+{
+  char  buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  char  name[FILE_NAME_SIZE];
+  Uint  watched;
+  while (true) {
+    ssize_t n   = read(watcher.fd, buf, sizeof buf);
+    bool    hit = false;
+    pthread_mutex_lock(&watcher.lock);
+    for (char* p = buf; n > 0 && p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event*)p)->len) {
+      struct inotify_event* e = (struct inotify_event*)p;
+      hit = hit || (e->wd == watcher.wd && e->len && !strcmp(e->name, watcher.base));
+    }
+    scpy(watcher.name, name, FILE_NAME_SIZE);
+    watched = watcher.watched;
+    pthread_mutex_unlock(&watcher.lock);
+    if (hit) read_file(name, watched);
+  }
+  return NULL;
+}
+
+// from the UI thread, grid_lock held: the document is now 'name'; a file
+// read for the last one is dropped
+void
+watch(char* name)
+{
+  char* slash = strrchr(name, '/');
+  char  dir[FILE_NAME_SIZE];
+  snprintf(dir, sizeof dir, "%.*s", slash ? (int)(slash - name) + (slash == name) : 1, slash ? name : ".");
+  pthread_mutex_lock(&watcher.lock);
+  if (watcher.wd >= 0) inotify_rm_watch(watcher.fd, watcher.wd);
+  watcher.wd = watcher.fd < 0 ? -1 : inotify_add_watch(watcher.fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+  scpy(name, watcher.name, FILE_NAME_SIZE);
+  scpy(slash ? slash + 1 : name, watcher.base, FILE_NAME_SIZE);
+  watcher.watched++;
+  Grid* stale = atomic_exchange(&watcher.pending, NULL);
+  pthread_mutex_unlock(&watcher.lock);
+  if (stale) { free_grid(stale); free(stale); }
+}
+
+// Watcher thread: reads 'name' into a grid of its own, no lock held, and
+// hands it to reload(); one not yet taken is replaced.  The writer's own
+// saves are left out.
+void
+read_file(char* name, Uint watched)
+{
+  struct stat st;
+  Document    d = { 0 };
+  if (stat(name, &st)) return;
+  pthread_mutex_lock(&watcher.own_lock);
+  bool own = st.st_ino == watcher.own_ino && st.st_mtim.tv_sec == watcher.own.tv_sec &&
+             st.st_mtim.tv_nsec == watcher.own.tv_nsec;
+  pthread_mutex_unlock(&watcher.own_lock);
+  if (own || !open_doc(&d, name)) return;
+  Grid* g = malloc(sizeof *g);
+  if (!g) { free_grid(&d.grid); return; }
+  *g = d.grid;
+  pthread_mutex_lock(&watcher.lock);
+  if (watched != watcher.watched) { free_grid(g); free(g); g = NULL; }  // another document since
+  Grid* old = g ? atomic_exchange(&watcher.pending, g) : NULL;
+  pthread_mutex_unlock(&watcher.lock);
+  if (old) { free_grid(old); free(old); }
+  if (g) SDL_PushEvent(&(SDL_Event){ .type = RELOAD });
+}
+
+// grid_lock held, between two frames (before the sequencer runs the next,
+// or from the UI when nothing plays): merges the grid the watcher read.
+// frame and vars are kept; the changed cells go to the journal like edits.
+void
+reload()
+{
+  if (!atomic_load(&watcher.pending)) return;
+  Grid* g = atomic_exchange(&watcher.pending, NULL);
+  Merge m;
+  if (!g) return;
+  merge_grid(&doc.grid, g, &m);
+  if (m.resized) {  // the journal cannot say that: start a new one from the file
+    if (!init_history(&history, &doc.grid, HISTORY_BYTES, HISTORY_STEPS)) free_history(&history);
+    follow(doc.name, false);
+  }
+  if (m.cells) journal(m.x0, m.y0, m.x1 - m.x0 + 1, m.y1 - m.y0 + 1);
+  free_grid(g);
+  free(g);
+  if (m.cells) printf("Reloaded: %s, %d cells\n", doc.name, m.cells);
+}
+
 // ==========================================================================  
 // ============================== Input & Init ==============================  
 // ==========================================================================  
@@ -1043,9 +883,9 @@ do_key(SDL_Event* event)
   bool ctrl  = SDL_GetModState() & KMOD_LCTRL  || SDL_GetModState() & KMOD_RCTRL;
   bool alt   = SDL_GetModState() & KMOD_LALT   || SDL_GetModState() & KMOD_RALT;
   if (ctrl) {
-    if      (event->key.keysym.sym == SDLK_n)            make_doc(&doc, FILE_NAME_DEFAULT);
-    else if (event->key.keysym.sym == SDLK_r)            open_doc(&doc, doc.name);
-    else if (event->key.keysym.sym == SDLK_s)            save_doc(&doc, doc.name);
+    if      (event->key.keysym.sym == SDLK_n)            make_file(FILE_NAME_DEFAULT);
+    else if (event->key.keysym.sym == SDLK_r)            open_file(doc.name);
+    else if (event->key.keysym.sym == SDLK_s)            save_file(doc.name);
     else if (event->key.keysym.sym == SDLK_h)            set_option(&GUIDES, !GUIDES);
     else if (event->key.keysym.sym == SDLK_i)            set_option(&MODE, !MODE);
     else if (event->key.keysym.sym == SDLK_a)            select1(0, 0, doc.grid.width, doc.grid.height);
@@ -1064,13 +904,15 @@ do_key(SDL_Event* event)
     else if (event->key.keysym.sym == SDLK_q)            quit();
   } else {
     if 	    (event->key.keysym.sym == SDLK_ESCAPE)       reset();
-    else if (event->key.keysym.sym == SDLK_PAGEUP)       set_option(&BPM, clamp(BPM + (alt ? 10 : 1), 1, 999));
-    else if (event->key.keysym.sym == SDLK_PAGEDOWN)     set_option(&BPM, clamp(BPM - (alt ? 10 : 1), 1, 999));
+    else if (event->key.keysym.sym == SDLK_PAGEUP)       set_shared(&BPM, clamp(atomic_load_explicit(&BPM, memory_order_relaxed) + (alt ? 10 : 1), 1, 999));
+    else if (event->key.keysym.sym == SDLK_PAGEDOWN)     set_shared(&BPM, clamp(atomic_load_explicit(&BPM, memory_order_relaxed) - (alt ? 10 : 1), 1, 999));
+    else if (event->key.keysym.sym == SDLK_HOME)         scrub(  alt ? 10 : 1);
+    else if (event->key.keysym.sym == SDLK_END)          scrub(-(alt ? 10 : 1));
     else if (event->key.keysym.sym == SDLK_UP)           shift ? scale( 0, -1, alt) : move( 0, -1, alt);
     else if (event->key.keysym.sym == SDLK_DOWN)         shift ? scale( 0,  1, alt) : move( 0,  1, alt);
     else if (event->key.keysym.sym == SDLK_LEFT)         shift ? scale(-1,  0, alt) : move(-1,  0, alt);
     else if (event->key.keysym.sym == SDLK_RIGHT)        shift ? scale( 1,  0, alt) : move( 1,  0, alt);
-    else if (event->key.keysym.sym == SDLK_SPACE)        { if (!MODE) set_option(&PAUSE, !PAUSE); }
+    else if (event->key.keysym.sym == SDLK_SPACE)        { if (!MODE) set_shared(&PAUSE, !atomic_load_explicit(&PAUSE, memory_order_relaxed)); }
     else if (event->key.keysym.sym == SDLK_BACKSPACE)    { insert('.'); if (MODE) move(-2, 0, alt); }
   }
 }
@@ -1094,19 +936,14 @@ create_window()
 bool
 create_renderer()
 {
-  return gRenderer = SDL_CreateRenderer(gWindow, -1, 0);
+  if (!(gRenderer = SDL_CreateRenderer(gWindow, -1, SDL_RENDERER_PRESENTVSYNC))) return false;
+  return !SDL_RenderSetLogicalSize(gRenderer, WIDTH, HEIGHT);  // ZOOM is applied by the GPU
 }
 
 bool
 create_texture()
 {
-  return gTexture = SDL_CreateTexture(gRenderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, WIDTH, HEIGHT);
-}
-
-bool
-create_pixelbufer()
-{
-  return pixels = calloc(WIDTH * HEIGHT, sizeof *pixels);
+  return gTexture = SDL_CreateTexture(gRenderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, ATLAS_W * 8, ATLAS_H * 8);
 }
 
 bool
@@ -1115,23 +952,33 @@ create_ui()
   if (!create_window())     return error("Window",   SDL_GetError());
   if (!create_renderer())   return error("Renderer", SDL_GetError());
   if (!create_texture())    return error("Texture",  SDL_GetError());
-  if (!create_pixelbufer()) return error("Pixels",   "Failed to allocate memory");
+  if (!init_atlas())        return error("Atlas",    SDL_GetError());
   return true;
 }
 
 bool
 init()
 {
-  if (SDL_Init(SDL_INIT_VIDEO) < 0) return error("Init", SDL_GetError());
-  if (!create_ui())                 return error("Init", "UI creation failed");
+  if (SDL_Init(SDL_INIT_VIDEO) < 0)                 return error("Init", SDL_GetError());
+  if (!create_ui())                                 return error("Init", "UI creation failed");
+  if ((TICK = SDL_RegisterEvents(2)) == (Uint32)-1) return error("Init", "No SDL user events left");
+  if (!init_writer())                               return error("Init", "Writer");
+  if (sem_init(&tick, 0, 0))                        return error("Init", "Semaphore");  // before JACK posts it
+  if (!init_watcher())                              error("Watch", "Files are not reloaded");
+  RELOAD = TICK + 1;
   init_midi();
+  for (int i = 0; i < DOCS; i++) {
+    Grid* g     = i ? &parts[i - 1].grid : &doc.grid;
+    g->midi     = send_midi;
+    g->midi_arg = &rings[i];
+  }
   return true;
 }
 
 void
 quit()
 {
-  free(pixels);
+  for (int i = 0; i < n_grids; i++) free_grid(grids[i]);
   SDL_DestroyTexture(gTexture);
   SDL_DestroyRenderer(gRenderer);
   SDL_DestroyWindow(gWindow);
@@ -1139,3 +986,11 @@ quit()
   jack_client_close(client);
   exit(0);
 }
+
+int
+usage(char* name)
+{
+  fprintf(stderr, "usage: %s [-p voices] [file.orca [part.orca ...]]\n", name);
+  return 1;
+}
+
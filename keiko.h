@@ -1,76 +1,105 @@
 #include <SDL2/SDL.h>
 #include <jack/jack.h>
 #include <jack/midiport.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
 #include <signal.h>
-#include <stdbool.h>
-#include <stdio.h>
+#include <stdatomic.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "engine.h"
 
 // ==============================================================================  
 // ============================== Data Definitions ==============================  
 // ==============================================================================  
 
-#define HOR     35
-#define VER     25
 #define PAD      2
-#define VOICES  16
 #define DEVICE   0
 
 #define SZ     (HOR * VER * 16)
 #define CLIPSZ (HOR * VER) + VER + 1
-#define MAXSZ  (HOR * VER)
 
-typedef unsigned char Uint8;
-typedef unsigned int  Uint;
-
-typedef enum cell_type { NoOp, Comment, LeftInput, Operator, RightInput, Output, Selected, } Type;
-
-#define N_VARS  36
+#define RING   1024  // note events in flight from send_midi to process, per grid; power of two
+#define DOCS   64    // grids played at once: the document and the parts playing along
+#define POLY   256   // voices in the voice table; -p sets how many may sound at once
+#define TICKS  64    // sequencer steps in flight from process to the sequencer thread; power of two
 
 typedef struct
 {
-  int    width;
-  int    height;
-  int    length;
-  int    frame;
-  int    random;       // seed value for random number generator; default = 1
-  Uint8  vars[N_VARS];
-  Uint8  data[MAXSZ];
-  bool   lock[MAXSZ];  // true = deactivate cell = cell does not contain an operator; false = cell contains a value
-  Type   type[MAXSZ];  // determines color representation
-} Grid;
-
-#define FILE_NAME_SIZE    256
-#define FILE_NAME_DEFAULT "untitled.orca"
+  int x, y;
+  int w, h; // width, height
+} Rect;
 
+#define FRESH  4  // set on the middle snapshot index: published, not yet taken by the renderer
+
+// what the renderer needs of the document: the visible cells, the frame
+// and whether it is saved
 typedef struct
 {
+  int   frame;
   bool  unsaved;
-  char  name[FILE_NAME_SIZE];
-  Grid  grid;
-} Document;
+  char  data[VER][HOR];
+  Uint8 type[VER][HOR];
+} Snapshot;
 
+// single-producer (sequencer) / single-consumer (JACK process) queue;
+// head and tail run freely and are masked on access
 typedef struct
 {
-  int x, y;
-  int w, h; // width, height
-} Rect;
+  MidiNote    notes[RING];
+  atomic_uint head;  // written by the producer only
+  atomic_uint tail;  // written by the consumer only
+} MidiRing;
 
+// same protocol as MidiRing, carrying the JACK frame each sequencer step is due at
 typedef struct
 {
-  int  channel;
-  int  value;
-  int  velocity;
-  int  length;
-  bool trigger;
-} MidiNote;
+  jack_nframes_t times[TICKS];
+  atomic_uint    head;
+  atomic_uint    tail;
+} TickRing;
 
-typedef struct midi_list MidiList;
+#define AUTOSAVE  5  // seconds between autosaves of an edited document, at least
 
-typedef struct midi_list
+// The writer thread does all file writing for the UI: saves, autosaves of
+// an edited document and the journal of edits since the last of those (see
+// recover_doc).  The UI and sequencer threads only ever wait for its lock
+// or for a copy of the grid, never for the disk.
+typedef struct
+{
+  pthread_t       thread;
+  pthread_mutex_t lock;
+  pthread_cond_t  wake;
+  char*           queue;    // journal records not yet written
+  size_t          used, size;
+  int             edits;    // edits since the last snapshot
+  bool            save;     // save_file() asked for a save to 'save_name'
+  bool            moved;    // the document changed: journal to 'name' from now on
+  bool            resume;   // and append to its journal; false = start a new one
+  char            name[FILE_NAME_SIZE];
+  char            save_name[FILE_NAME_SIZE];
+} Writer;
+
+// The watcher thread reloads the document when another program writes it:
+// the file is read on this thread and the grid handed over in 'pending',
+// which reload() merges between two frames.
+typedef struct
 {
-  MidiNote  note;
-  MidiList* next;
-} MidiList;
+  pthread_t       thread;
+  pthread_mutex_t lock;
+  int             fd;       // inotify
+  int             wd;       // the document's directory; -1 = none
+  Uint            watched;  // bumped by watch(): a file being read is stale
+  char            name[FILE_NAME_SIZE];
+  char            base[FILE_NAME_SIZE];  // name without its directory
+  pthread_mutex_t own_lock; // held by the writer while it saves; the UI never waits for it
+  struct timespec own;      // mtime of the file the writer last saved, which is not reloaded
+  ino_t           own_ino;
+  _Atomic(Grid*)  pending;  // read, not yet merged; taken by reload()
+} Watcher;
 
 // ==============================================================================  
 // ============================== Global Variables ==============================  
@@ -79,14 +108,45 @@ typedef struct midi_list
 jack_client_t* client;
 jack_port_t*   output_port;
 
-Document  doc;
-char      clip[CLIPSZ];
-MidiList* voices;
-Rect      cursor;
+Document   doc;
+Document   parts[DOCS - 1];              // play along with doc; not shown, edited or reloaded
+Grid*      grids[DOCS] = { &doc.grid };  // run together every frame, doc's first
+int        n_grids     = 1;
+Pool       pool;                         // runs grids for whoever holds grid_lock
+Writer     writer = { .lock = PTHREAD_MUTEX_INITIALIZER, .wake = PTHREAD_COND_INITIALIZER };
+Watcher    watcher = { .lock = PTHREAD_MUTEX_INITIALIZER, .own_lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1, .wd = -1 };
+History    history;       // doc.grid's last frames; HOME and END move through them
+char       clip[CLIPSZ];
+MidiRing   rings[DOCS];   // one per grid, the one it sends to; drained together by process()
+Voices     voices;        // owned by process(); never touched by other threads
+atomic_int active;        // voices.count as last published by process(), for the UI
+Rect       cursor;
+
+TickRing        ticks;
+sem_t           tick;                                  // posted by process() for every step it queues
+atomic_bool     sequencing;                            // the sequencer thread runs; until then no step is queued
+pthread_t       sequencer;
+pthread_mutex_t grid_lock = PTHREAD_MUTEX_INITIALIZER;  // held by whoever reads or writes a grid
+Uint32          TICK;                                  // SDL event type: the sequencer ran a frame
+Uint32          RELOAD;                                // SDL event type: the watcher read the document
+jack_nframes_t  tick_time;                             // JACK frame of the step being run; stamps send_midi
+Uint64          clock_frames;                          // samples since activation; process() only
+Uint64          next_tick;                             // sample the next step is due at; process() only
+Uint64          tick_rest;                             // part of a sample carried between steps, in 1/BPM samples
+
+Snapshot    snaps[3];           // triple buffer: one written, one drawn, one in between
+int         back = 1, front = 2; // written by publish() under grid_lock / read by the UI thread
+atomic_int  middle;             // index of the in-between snapshot, | FRESH when unseen
+atomic_bool ticked;             // a TICK event is queued and not yet handled
 
 int WIDTH  = 8 * HOR + PAD * 8 * 2;
 int HEIGHT = 8 * (VER + 2) + PAD * 8 * 2;
-int BPM    = 120, DOWN = 0, ZOOM = 2, PAUSE = 0, GUIDES = 1, MODE = 0;  // GUIDES = UI grid (dots), MODE = input mode
+int DOWN   = 0, ZOOM = 2, GUIDES = 1, MODE = 0, DIRTY = 0;  // GUIDES = UI grid (dots), MODE = input mode, DIRTY = redraw due
+
+// options the JACK thread reads too: relaxed loads and stores only
+atomic_int BPM       = 120;
+atomic_int PAUSE     = 0;
+atomic_int POLYPHONY = POLY;  // voices sounding at once; a note beyond that steals the oldest one (-p)
 
 Uint32 theme[] = { 0x000000, 0xFFFFFF, 0x72DEC2, 0x666666, 0xffb545 };
 
@@ -179,123 +239,100 @@ Uint8 font[][8] = {
   { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }
 };
 
-SDL_Window*   gWindow;
-SDL_Renderer* gRenderer;
-SDL_Texture*  gTexture;
-Uint32*       pixels;
-
-// ==============================================================================  
-// ============================== Helper Functions ==============================  
-// ==============================================================================  
+#define FONTS   (int)(sizeof font  / sizeof *font)
+#define GLYPHS  (FONTS + (int)(sizeof icons / sizeof *icons))
+#define ICON(i) (FONTS + (i))  // glyph number of icons[i]; font[i] is glyph i
+#define SOLID   GLYPHS         // atlas tile with every pixel set, drawn under each glyph in the background colour
+#define ATLAS_W 16             // atlas size in 8x8 tiles
+#define ATLAS_H ((GLYPHS + ATLAS_W) / ATLAS_W)
+#define CELLS   (HOR * (VER + 2))  // grid cells, blank row and status bar
 
-int    clamp(int val, int min, int max);
-bool   cisp(char c);
-char   cchr(int v, char c);
-int    cb36(char c);
-char   cuca(char c);
-char   clca(char c);
-char   cinc(char c);
-char   cdec(char c);
-bool   valid_position(Grid* g, int x, int y);
-bool   valid_character(char c);
-int    ctbl(char c);
-char*  scpy(char* src, char* dst, int len);
-char   get_cell(Grid* g, int x, int y);
-void   set_cell(Grid* g, int x, int y, char c);
-Type   get_type(Grid* g, int x, int y);
-void   set_type(Grid* g, int x, int y, Type type);
-void   set_lock(Grid* g, int x, int y);
-void   set_port(Grid* g, int x, int y, char c);
-int    get_port(Grid* g, int x, int y, bool lock);
-bool   bangged(Grid* g, int x, int y);
-size_t get_list_length();
-bool   error(char* msg, const char* err);
+SDL_Vertex verts[CELLS * 8];    // per cell: background quad, then glyph quad
+int        quads[CELLS * 12];   // two triangles per quad; never changes
+Uint32     drawn[VER + 2][HOR]; // glyph << 8 | fg << 4 | bg last written to each cell's vertices
 
-// ==================================================================
-// ============================== MIDI ==============================
-// ==================================================================
-
-int  process(jack_nframes_t nframes, void* arg);
-void send_midi(int channel, int value, int velocity, int length);
-bool init_midi();
+SDL_Window*   gWindow;
+SDL_Renderer* gRenderer;
+SDL_Texture*  gTexture;  // glyph atlas
 
 // =======================================================================
 // ============================== Operators ==============================
 // =======================================================================
 
-void operate(Grid* g, int x, int y, char c);
-void run_grid(Grid* g);
-void init_grid_frame(Grid* g);
-void init_grid(Grid* g, int w, int h);
-void op_a(Grid* g, int x, int y);
-void op_b(Grid* g, int x, int y);
-void op_c(Grid* g, int x, int y);
-void op_d(Grid* g, int x, int y);
-void op_e(Grid* g, int x, int y, char c);
-void op_f(Grid* g, int x, int y);
-void op_g(Grid* g, int x, int y);
-void op_h(Grid* g, int x, int y);
-void op_i(Grid* g, int x, int y);
-void op_j(Grid* g, int x, int y, char c);
-void op_k(Grid* g, int x, int y);
-void op_l(Grid* g, int x, int y);
-void op_m(Grid* g, int x, int y);
-void op_n(Grid* g, int x, int y, char c);
-void op_o(Grid* g, int x, int y);
-void op_p(Grid* g, int x, int y);
-void op_q(Grid* g, int x, int y);
-void op_r(Grid* g, int x, int y);
-void op_s(Grid* g, int x, int y, char c);
-void op_t(Grid* g, int x, int y);
-void op_u(Grid* g, int x, int y);
-void op_v(Grid* g, int x, int y);
-void op_w(Grid* g, int x, int y, char c);
-void op_x(Grid* g, int x, int y);
-void op_y(Grid* g, int x, int y, char c);
-void op_z(Grid* g, int x, int y);
-void op_comment(Grid* g, int x, int y);
-void op_midi(Grid* g, int x, int y);
+void      frame();
+void      scrub(int n);
+void*     sequence(void* arg);
+void      publish(Document* d);
+Snapshot* take_snapshot();
+bool      init_sequencer();
 
-// =======================================================================
-// ============================== Debugging ==============================
-// =======================================================================
+// ==================================================================
+// ============================== MIDI ==============================
+// ==================================================================
 
-void print_data_grid(Grid* g);
-void print_lock_grid(Grid* g);
-void print_type_grid(Grid* g);
+bool   push_note(MidiRing* r, MidiNote* n);
+bool   pop_note(MidiRing* r, MidiNote* n);
+int    process(jack_nframes_t nframes, void* arg);
+bool   push_tick(TickRing* r, jack_nframes_t t);
+bool   pop_tick(TickRing* r, jack_nframes_t* t);
+void   queue_ticks(jack_nframes_t start, jack_nframes_t n_frames);
+void   send_midi(void* arg, int channel, int value, int velocity, int length);
+bool   init_midi();
 
 // =====================================================================
 // ============================== UI ===================================
 // =====================================================================
 
 int  get_font(int x, int y, char c, int type, int sel);
-void set_pixel(Uint32* dst, int x, int y, int color);
-void draw_icon(Uint32* dst, int x, int y, Uint8* icon, int fg, int bg);
-void draw_ui(Uint32* dst);
-void redraw(Uint32* dst);
+bool init_atlas();
+void set_quad(SDL_Vertex* v, int x, int y, int tile, int color);
+void draw_icon(int x, int y, int glyph, int fg, int bg);
+void draw_ui(Snapshot* s);
+void redraw();
 
 // =======================================================================
 // ============================== Documents ==============================
 // =======================================================================
 
-void make_doc(Document* d, char* name);
-bool open_doc(Document* d, char* name);
-void save_doc(Document* d, char* name);
+void make_file(char* name);
+bool open_file(char* name);
+bool add_part(char* name);
+void save_file(char* name);
 void transform(Rect* r, char (*fn)(char));
 void set_option(int* i, int v);
+void set_shared(atomic_int* i, int v);
 void select1(int x, int y, int w, int h);
 void scale(int w, int h, bool skip);
 void move(int x, int y, bool skip);
 void reset();
 void comment(Rect* r);
 void insert(char c);
-void frame();
 void select_option(int option);
 void copy_clip(Rect* r, char* c);
 void cut_clip(Rect* r, char* c);
 void paste_clip(Rect* r, char* c, bool insert);
 void move_clip(Rect* r, char* c, int x, int y, bool skip);
 
+// ====================================================================
+// ============================== Writer ==============================
+// ====================================================================
+
+bool  init_writer();
+void* write_files(void* arg);
+bool  append_file(int fd, char* text, size_t n);
+void  journal(int x, int y, int w, int h);
+void  follow(char* name, bool resume);
+
+// =====================================================================
+// ============================== Watcher ==============================
+// =====================================================================
+
+bool  init_watcher();
+void* watch_files(void* arg);
+void  watch(char* name);
+void  read_file(char* name, Uint watched);
+void  reload();
+
 // ==========================================================================  
 // ============================== Input & Init ==============================  
 // ==========================================================================  
@@ -306,7 +343,7 @@ void do_text(SDL_Event* event);
 bool create_window();
 bool create_renderer();
 bool create_texture();
-bool create_pixelbufer();
 bool create_ui();
 bool init();
 void quit();
+int  usage(char* name);